@@ -3,7 +3,6 @@
 #include "utils/com_error_handler.h"
 #include "utils/window.h"
 
-#define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h>
 
 #include <filesystem>
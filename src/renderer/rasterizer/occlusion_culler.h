@@ -0,0 +1,207 @@
+#pragma once
+
+#include "rasterizer.h"
+
+#include <cmath>
+#include <limits>
+#include <memory>
+
+
+namespace cg::renderer
+{
+	// Coarse occlusion culling of whole shapes: a few large occluders are rasterized
+	// into a low resolution depth buffer, then each shape is tested by its bounding box.
+	// The buffer is conservative, so a shape is only culled when it is hidden at full
+	// resolution too: a pixel keeps the farthest depth of an occluder triangle covering
+	// all of it, and pixels no single triangle covers stay empty.
+	template<typename VB>
+	class occlusion_culler
+	{
+	public:
+		occlusion_culler();
+		~occlusion_culler(){};
+
+		void set_viewport(size_t in_width, size_t in_height);
+		// Model to clip space transform shared by occluders and tested boxes
+		void set_transform(const float4x4& in_transform);
+
+		void clear();
+		// Triangles crossing the near plane are left out rather than clipped
+		void add_occluder(
+				std::shared_ptr<resource<VB>> vertex_buffer,
+				std::shared_ptr<resource<unsigned int>> index_buffer);
+
+		// False only when the box is outside the view volume or entirely behind occluder depth.
+		// Boxes reaching the near plane are always visible.
+		bool is_visible(const float3& box_min, const float3& box_max) const;
+
+	protected:
+		// Screen x, y in pixels and depth of the three corners
+		void rasterize_occluder(const float3& v0, const float3& v1, const float3& v2);
+
+		std::shared_ptr<resource<float>> depth_buffer;
+		float4x4 transform = linalg::identity;
+		std::vector<float3> projected;
+		std::vector<unsigned char> in_front;
+
+		size_t width = 256;
+		size_t height = 144;
+	};
+
+	template<typename VB>
+	inline occlusion_culler<VB>::occlusion_culler()
+	{
+		set_viewport(width, height);
+	}
+
+	template<typename VB>
+	inline void occlusion_culler<VB>::set_viewport(size_t in_width, size_t in_height)
+	{
+		width = std::max(in_width, size_t{1});
+		height = std::max(in_height, size_t{1});
+		depth_buffer = std::make_shared<resource<float>>(width, height);
+		clear();
+	}
+
+	template<typename VB>
+	inline void occlusion_culler<VB>::set_transform(const float4x4& in_transform)
+	{
+		transform = in_transform;
+	}
+
+	template<typename VB>
+	inline void occlusion_culler<VB>::clear()
+	{
+		for (size_t i = 0; i < depth_buffer->count(); ++i)
+		{
+			depth_buffer->item(i) = DEFAULT_DEPTH;
+		}
+	}
+
+	template<typename VB>
+	inline void occlusion_culler<VB>::add_occluder(
+			std::shared_ptr<resource<VB>> vertex_buffer,
+			std::shared_ptr<resource<unsigned int>> index_buffer)
+	{
+		projected.resize(vertex_buffer->count());
+		in_front.resize(vertex_buffer->count());
+		for (size_t i = 0; i < vertex_buffer->count(); ++i)
+		{
+			const float4 position = mul(transform, float4{vertex_buffer->item(i).position, 1.f});
+			in_front[i] = position.z >= 0.f && position.w > 0.f;
+			projected[i] = float3{
+					(position.x / position.w + 1.f) * 0.5f * width,
+					(1.f - position.y / position.w) * 0.5f * height,
+					position.z / position.w};
+		}
+
+		for (size_t i = 0; i + 2 < index_buffer->count(); i += 3)
+		{
+			const unsigned int i0 = index_buffer->item(i);
+			const unsigned int i1 = index_buffer->item(i + 1);
+			const unsigned int i2 = index_buffer->item(i + 2);
+			if (in_front[i0] && in_front[i1] && in_front[i2])
+			{
+				rasterize_occluder(projected[i0], projected[i1], projected[i2]);
+			}
+		}
+	}
+
+	template<typename VB>
+	inline void occlusion_culler<VB>::rasterize_occluder(const float3& v0, const float3& v1, const float3& v2)
+	{
+		const float3 v[3] = {v0, v1, v2};
+		const float area = (v1.x - v0.x) * (v2.y - v0.y) - (v1.y - v0.y) * (v2.x - v0.x);
+		if (!(std::abs(area) > 0.f))
+		{
+			return;
+		}
+		// Depth is affine in screen space; its gradient bounds the depth over a whole pixel
+		const float dz_dx = ((v1.z - v0.z) * (v2.y - v0.y) - (v2.z - v0.z) * (v1.y - v0.y)) / area;
+		const float dz_dy = ((v2.z - v0.z) * (v1.x - v0.x) - (v1.z - v0.z) * (v2.x - v0.x)) / area;
+		const float depth_extent = 0.5f * (std::abs(dz_dx) + std::abs(dz_dy));
+		const float max_z = std::max({v0.z, v1.z, v2.z});
+
+		const auto to_pixel = [](float coordinate, size_t size) {
+			return static_cast<int>(std::floor(std::clamp(coordinate, -1.f, size + 1.f)));
+		};
+		const int min_x = std::max(to_pixel(std::min({v0.x, v1.x, v2.x}), width), 0);
+		const int max_x = std::min(to_pixel(std::max({v0.x, v1.x, v2.x}), width), static_cast<int>(width) - 1);
+		const int min_y = std::max(to_pixel(std::min({v0.y, v1.y, v2.y}), height), 0);
+		const int max_y = std::min(to_pixel(std::max({v0.y, v1.y, v2.y}), height), static_cast<int>(height) - 1);
+
+		const float orientation = area > 0.f ? 1.f : -1.f;
+		for (int y = min_y; y <= max_y; ++y)
+		{
+			for (int x = min_x; x <= max_x; ++x)
+			{
+				const float center_x = x + 0.5f;
+				const float center_y = y + 0.5f;
+				// The pixel is covered when its corner nearest to each edge is inside
+				bool covered = true;
+				for (int e = 0; e < 3 && covered; ++e)
+				{
+					const float3& a = v[(e + 1) % 3];
+					const float3& b = v[(e + 2) % 3];
+					const float edge = orientation * ((b.x - a.x) * (center_y - a.y) - (b.y - a.y) * (center_x - a.x));
+					covered = edge - 0.5f * (std::abs(b.x - a.x) + std::abs(b.y - a.y)) >= 0.f;
+				}
+				if (!covered)
+				{
+					continue;
+				}
+				const float center_z = v0.z + (center_x - v0.x) * dz_dx + (center_y - v0.y) * dz_dy;
+				const float far_z = std::min(center_z + depth_extent, max_z);
+				depth_buffer->item(x, y) = std::min(depth_buffer->item(x, y), far_z);
+			}
+		}
+	}
+
+	template<typename VB>
+	inline bool occlusion_culler<VB>::is_visible(const float3& box_min, const float3& box_max) const
+	{
+		float3 ndc_min{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()};
+		float3 ndc_max{std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()};
+		for (int corner = 0; corner < 8; ++corner)
+		{
+			const float4 position = mul(transform, float4{
+					corner & 1 ? box_max.x : box_min.x,
+					corner & 2 ? box_max.y : box_min.y,
+					corner & 4 ? box_max.z : box_min.z,
+					1.f});
+			if (position.z < 0.f || position.w <= 0.f)
+			{
+				return true;
+			}
+			const float3 projected_corner = float3{position.x, position.y, position.z} / position.w;
+			ndc_min = min(ndc_min, projected_corner);
+			ndc_max = max(ndc_max, projected_corner);
+		}
+
+		if (ndc_max.x < -1.f || ndc_min.x > 1.f || ndc_max.y < -1.f || ndc_min.y > 1.f || ndc_min.z > 1.f)
+		{
+			return false;
+		}
+
+		// Every pixel the screen rectangle of the box touches
+		const auto to_pixel = [](float ndc, size_t size) {
+			return static_cast<int>(std::floor(std::clamp((ndc + 1.f) * 0.5f * size, -1.f, size + 1.f)));
+		};
+		const int min_x = std::max(to_pixel(ndc_min.x, width), 0);
+		const int max_x = std::min(to_pixel(ndc_max.x, width), static_cast<int>(width) - 1);
+		const int min_y = std::max(to_pixel(-ndc_max.y, height), 0);
+		const int max_y = std::min(to_pixel(-ndc_min.y, height), static_cast<int>(height) - 1);
+
+		for (int y = min_y; y <= max_y; ++y)
+		{
+			for (int x = min_x; x <= max_x; ++x)
+			{
+				if (depth_buffer->item(x, y) >= ndc_min.z)
+				{
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+}// namespace cg::renderer
@@ -1,12 +1,26 @@
 #pragma once
 
 #include "resource.h"
+#include "utils/spsc_queue.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <exception>
 #include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <limits>
 #include <memory>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 
 using namespace linalg::aliases;
@@ -15,24 +29,339 @@ static constexpr float DEFAULT_DEPTH = std::numeric_limits<float>::max();
 
 namespace cg::renderer
 {
-	template<typename VB, typename RT>
+	// Vertex shader output in homogeneous clip space
+	template<typename VB>
+	struct clip_vertex
+	{
+		float4 position;
+		VB data;
+		// Set by the vertex stage; vertices created by clipping are projected during setup
+		bool projected = false;
+		int2 screen{};
+		float z = 0.f;
+	};
+
+	// Vertex stage output for the bound vertex range, kept as structure of arrays
+	// so positions are transformed and projected 8 at a time.
+	// Screen positions (fixed point) and depth are only valid where clip_w > 0.
+	struct vertex_scratch
+	{
+		std::vector<float> position_x, position_y, position_z;
+		std::vector<float> clip_x, clip_y, clip_z, clip_w;
+		std::vector<int> screen_x, screen_y;
+		std::vector<float> depth;
+
+		static constexpr size_t BATCH_SIZE = 8;
+		void resize(size_t count);
+	};
+
+	inline void vertex_scratch::resize(size_t count)
+	{
+		// Pad to whole batches so the SIMD loops never need a tail
+		const size_t padded = (count + BATCH_SIZE - 1) / BATCH_SIZE * BATCH_SIZE;
+		for (auto* lane: {&position_x, &position_y, &position_z, &clip_x, &clip_y, &clip_z, &clip_w, &depth})
+		{
+			lane->resize(padded);
+		}
+		screen_x.resize(padded);
+		screen_y.resize(padded);
+	}
+
+	// One indexed shape in a multi_draw batch
+	template<typename VB>
+	struct draw_range
+	{
+		std::shared_ptr<resource<VB>> vertex_buffer;
+		std::shared_ptr<resource<unsigned int>> index_buffer;
+		size_t num_indexes;
+		size_t index_offset;
+	};
+
+	enum class cull_mode
+	{
+		none,
+		back,
+		front
+	};
+
+	// A fragment passes when its depth compares this way against the stored one
+	enum class depth_func
+	{
+		less,
+		less_equal,
+		equal
+	};
+
+	// Pass in place of a pixel shader to only write the depth buffer: no attribute
+	// interpolation and no render target writes, e.g. for Z-prepasses and shadow maps
+	struct depth_only
+	{
+	};
+
+	// Triangle after the vertex shader and the viewport transform,
+	// ready to be scanned by any number of tiles.
+	// Screen positions are fixed point with SUBPIXEL_BITS of fraction; each edge
+	// equation E(x, y) = edge_origin + x * edge_step_x + y * edge_step_y is
+	// evaluated at pixel centers and already carries the top-left fill rule bias.
+	template<typename VB>
+	struct raster_triangle
+	{
+		int2 screen[3];
+		float z[3];
+		VB data[3];
+		int min_x, max_x, min_y, max_y;
+		int64_t edge_origin[3];
+		int64_t edge_step_x[3];
+		int64_t edge_step_y[3];
+		int edge_bias[3];
+		float inv_area;
+		// 1 / clip w of each corner: attributes are interpolated perspective correct
+		float inv_w[3];
+		float min_z, max_z;
+		bool simd_steps;
+		// Triangles within 2x2 pixels: covered pixel centers as bit (y - min_y) * 2 + x - min_x,
+		// found during setup. 0 for larger triangles, which walk their bounding box.
+		unsigned int small_coverage;
+		// Packed (draw id, triangle id) written in visibility buffer mode
+		unsigned int id;
+	};
+
+	// Min/max depth of every 8x8 block and every TILE_SIZE tile of a depth buffer.
+	// Depth only decreases between clears, so stale maxima stay conservative.
+	class depth_pyramid
+	{
+	public:
+		static constexpr int BLOCK_SIZE = 8;
+
+		void resize(size_t in_width, size_t in_height, int in_tile_size);
+		void clear(float depth);
+		template<typename Layout>
+		void update_block(resource<float, Layout>& depth_buffer, int x, int y);
+		// Single pixel write: lowers the block minimum now, while the maximum stays
+		// conservative until refresh_tiles recomputes it
+		void update_pixel(int x, int y, float depth);
+		template<typename Layout>
+		void refresh_tiles(resource<float, Layout>& depth_buffer);
+
+		size_t block_index(int x, int y) const;
+		size_t tile_index(int x, int y) const;
+
+		std::vector<float> block_min;
+		std::vector<float> block_max;
+		std::vector<float> tile_max;
+
+	protected:
+		size_t width = 0;
+		size_t height = 0;
+		int tile_size = 64;
+		size_t blocks_x = 0;
+		size_t tiles_x = 0;
+		std::vector<uint8_t> tile_dirty;
+		std::vector<uint8_t> block_stale;
+	};
+
+	inline void depth_pyramid::resize(size_t in_width, size_t in_height, int in_tile_size)
+	{
+		width = in_width;
+		height = in_height;
+		tile_size = in_tile_size;
+		blocks_x = (width + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		tiles_x = (width + tile_size - 1) / tile_size;
+		const size_t blocks_y = (height + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		const size_t tiles_y = (height + tile_size - 1) / tile_size;
+
+		// Contents are unknown until the next clear, so nothing may be rejected
+		block_min.assign(blocks_x * blocks_y, -std::numeric_limits<float>::infinity());
+		block_max.assign(blocks_x * blocks_y, std::numeric_limits<float>::infinity());
+		tile_max.assign(tiles_x * tiles_y, std::numeric_limits<float>::infinity());
+		tile_dirty.assign(tiles_x * tiles_y, 0);
+		block_stale.assign(blocks_x * blocks_y, 0);
+	}
+
+	inline void depth_pyramid::clear(float depth)
+	{
+		std::fill(block_min.begin(), block_min.end(), depth);
+		std::fill(block_max.begin(), block_max.end(), depth);
+		std::fill(tile_max.begin(), tile_max.end(), depth);
+		std::fill(tile_dirty.begin(), tile_dirty.end(), 0);
+		std::fill(block_stale.begin(), block_stale.end(), 0);
+	}
+
+	template<typename Layout>
+	inline void depth_pyramid::update_block(resource<float, Layout>& depth_buffer, int x, int y)
+	{
+		const int max_x = std::min(x + BLOCK_SIZE, static_cast<int>(width));
+		const int max_y = std::min(y + BLOCK_SIZE, static_cast<int>(height));
+		float min_depth = std::numeric_limits<float>::infinity();
+		float max_depth = -std::numeric_limits<float>::infinity();
+		for (int j = y; j < max_y; ++j)
+		{
+			for (int i = x; i < max_x; ++i)
+			{
+				const float depth = depth_buffer.item(i, j);
+				min_depth = std::min(min_depth, depth);
+				max_depth = std::max(max_depth, depth);
+			}
+		}
+
+		const size_t block = block_index(x, y);
+		block_min[block] = min_depth;
+		block_max[block] = max_depth;
+		block_stale[block] = 0;
+		tile_dirty[tile_index(x, y)] = 1;
+	}
+
+	inline void depth_pyramid::update_pixel(int x, int y, float depth)
+	{
+		const size_t block = block_index(x, y);
+		block_min[block] = std::min(block_min[block], depth);
+		block_stale[block] = 1;
+		tile_dirty[tile_index(x, y)] = 1;
+	}
+
+	template<typename Layout>
+	inline void depth_pyramid::refresh_tiles(resource<float, Layout>& depth_buffer)
+	{
+		const int blocks_per_tile = tile_size / BLOCK_SIZE;
+		for (size_t tile = 0; tile < tile_dirty.size(); ++tile)
+		{
+			if (!tile_dirty[tile])
+			{
+				continue;
+			}
+			const int tile_x = static_cast<int>(tile % tiles_x) * tile_size;
+			const int tile_y = static_cast<int>(tile / tiles_x) * tile_size;
+			float max_depth = -std::numeric_limits<float>::infinity();
+			for (int by = 0; by < blocks_per_tile && tile_y + by * BLOCK_SIZE < static_cast<int>(height); ++by)
+			{
+				for (int bx = 0; bx < blocks_per_tile && tile_x + bx * BLOCK_SIZE < static_cast<int>(width); ++bx)
+				{
+					const int block_x = tile_x + bx * BLOCK_SIZE;
+					const int block_y = tile_y + by * BLOCK_SIZE;
+					if (block_stale[block_index(block_x, block_y)])
+					{
+						update_block(depth_buffer, block_x, block_y);
+					}
+					max_depth = std::max(max_depth, block_max[block_index(block_x, block_y)]);
+				}
+			}
+			tile_max[tile] = max_depth;
+			tile_dirty[tile] = 0;
+		}
+	}
+
+	inline size_t depth_pyramid::block_index(int x, int y) const
+	{
+		return (y / BLOCK_SIZE) * blocks_x + x / BLOCK_SIZE;
+	}
+
+	inline size_t depth_pyramid::tile_index(int x, int y) const
+	{
+		return (y / tile_size) * tiles_x + x / tile_size;
+	}
+
+	// Layout is the storage order of the render target, depth and visibility buffers
+	template<typename VB, typename RT, typename Layout = linear_layout>
 	class rasterizer
 	{
 	public:
 		rasterizer(){};
 		~rasterizer(){};
 		void set_render_target(
-				std::shared_ptr<resource<RT>> in_render_target,
-				std::shared_ptr<resource<float>> in_depth_buffer = nullptr);
+				std::shared_ptr<resource<RT, Layout>> in_render_target,
+				std::shared_ptr<resource<float, Layout>> in_depth_buffer = nullptr);
+		// Fast clear: only the clear values are recorded and every TILE_SIZE tile is
+		// filled when it is first rasterized into. resolve() fills the untouched tiles
+		// in parallel and must run before the targets are read or saved.
 		void clear_render_target(
 				const RT& in_clear_value, const float in_depth = DEFAULT_DEPTH);
+		void resolve();
 
 		void set_vertex_buffer(std::shared_ptr<resource<VB>> in_vertex_buffer);
 		void set_index_buffer(std::shared_ptr<resource<unsigned int>> in_index_buffer);
 
 		void set_viewport(size_t in_width, size_t in_height);
 
+		// Both draws run the vertex stage once over the referenced vertex range,
+		// then assemble triangles from the transformed vertices
 		void draw(size_t num_vertexes, size_t vertex_offset);
+		void draw_indexed(size_t num_indexes, size_t index_offset);
+
+		// Compile-time shader binding: the shaders are functors that get inlined into
+		// the vertex and raster loops. Pass nullptr as the vertex shader to use the
+		// fixed-function transform. Draws using the std::function members forward here.
+		// A pixel shader taking (data, z, ddx, ddy) also gets the screen-space derivatives
+		// of the interpolated attributes, e.g. to pick texture mip levels.
+		template<typename VS, typename PS>
+		void draw(size_t num_vertexes, size_t vertex_offset, const VS& in_vertex_shader, const PS& in_pixel_shader);
+		template<typename VS, typename PS>
+		void draw_indexed(size_t num_indexes, size_t index_offset, const VS& in_vertex_shader, const PS& in_pixel_shader);
+
+		// Clip-space transform of the fixed-function vertex stage, used while no vertex_shader is bound
+		void set_transform(const float4x4& in_transform);
+
+		// Batched submission: all triangles of the batch are set up, binned and
+		// rasterized in one pass, in submission order.
+		// draw_instanced draws the bound mesh once per world matrix with the
+		// fixed-function transform, i.e. set_transform() holds the view-projection.
+		// multi_draw binds each range's buffers in turn and restores the bound ones.
+		void draw_instanced(
+				size_t num_indexes, size_t index_offset, std::shared_ptr<resource<float4x4>> instance_transforms);
+		template<typename PS>
+		void draw_instanced(
+				size_t num_indexes, size_t index_offset, std::shared_ptr<resource<float4x4>> instance_transforms,
+				const PS& in_pixel_shader);
+		void multi_draw(const std::vector<draw_range<VB>>& ranges);
+		template<typename VS, typename PS>
+		void multi_draw(const std::vector<draw_range<VB>>& ranges, const VS& in_vertex_shader, const PS& in_pixel_shader);
+
+		// Sort-middle mode: triangles are set up once, binned into screen tiles,
+		// and the tiles are rasterized in parallel. Results match the serial path.
+		void set_tile_binning(bool in_tile_binning);
+		static constexpr int TILE_SIZE = 64;
+
+		// Pipelined multi_draw: a geometry thread runs the vertex stage, triangle setup and
+		// binning of each range and hands the binned triangles over a bounded queue, so the
+		// next ranges are processed while the current one is rasterized. Needs tile binning;
+		// ignored with a visibility buffer, whose triangle ids are per draw.
+		void set_pipelining(bool in_pipelining);
+		// Binned ranges in flight between the stages
+		static constexpr size_t PIPELINE_DEPTH = 4;
+
+		// Evaluate coverage and depth for 8 pixels at a time when built with AVX2
+		// (-DCG_AVX2=ON). The scalar path stays available for correctness checks.
+		void set_simd(bool in_simd);
+
+		static constexpr int SUBPIXEL_BITS = 4;
+		static constexpr int SUBPIXEL_ONE = 1 << SUBPIXEL_BITS;
+		// Triangles are only clipped against x/y when they reach this far past the viewport
+		static constexpr int GUARD_BAND = 8192;
+
+		// Counter-clockwise triangles are front facing
+		void set_cull_mode(cull_mode in_cull_mode);
+
+		// Use depth_func::equal to shade after a depth_only prepass
+		void set_depth_func(depth_func in_depth_func);
+
+		// 4x MSAA: coverage and depth are tested per sample, the pixel shader still runs
+		// once per pixel and triangle. resolve() averages the samples into the render
+		// target; the depth buffer holds the farthest sample of each pixel.
+		void set_msaa(bool in_msaa);
+		static constexpr int MSAA_SAMPLES = 4;
+		// Rotated grid, in subpixels from the pixel center
+		static constexpr int SAMPLE_OFFSET_X[MSAA_SAMPLES] = {-2, 6, -6, 2};
+		static constexpr int SAMPLE_OFFSET_Y[MSAA_SAMPLES] = {-6, -2, 2, 6};
+
+		// Visibility buffer mode: draws only write depth and a packed (draw id, triangle id)
+		// per pixel and keep their triangle setups until the next clear.
+		// resolve_visibility() then runs the pixel shader once per covered pixel.
+		void set_visibility_buffer(std::shared_ptr<resource<unsigned int, Layout>> in_visibility_buffer);
+		void resolve_visibility();
+		template<typename PS>
+		void resolve_visibility(const PS& in_pixel_shader);
+		static constexpr unsigned int TRIANGLE_ID_BITS = 20;
+		static constexpr unsigned int TRIANGLE_ID_MASK = (1u << TRIANGLE_ID_BITS) - 1;
+		static constexpr unsigned int INVALID_VISIBILITY_ID = std::numeric_limits<unsigned int>::max();
 
 		std::function<std::pair<float4, VB>(float4 vertex, VB vertex_data)> vertex_shader;
 		std::function<cg::color(const VB& vertex_data, const float z)> pixel_shader;
@@ -40,143 +369,1653 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::resource<VB>> vertex_buffer;
 		std::shared_ptr<cg::resource<unsigned int>> index_buffer;
-		std::shared_ptr<cg::resource<RT>> render_target;
-		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<RT, Layout>> render_target;
+		std::shared_ptr<cg::resource<float, Layout>> depth_buffer;
+		std::shared_ptr<cg::resource<unsigned int, Layout>> visibility_buffer;
 
 		size_t width = 1920;
 		size_t height = 1080;
 
-		int edge_function(int2 a, int2 b, int2 c);
+		bool tile_binning = true;
+		bool pipelining = false;
+		bool simd = true;
+		bool msaa = false;
+		cull_mode culling = cull_mode::none;
+		depth_func depth_function = depth_func::less;
+
+		RT clear_value{};
+		float clear_depth = DEFAULT_DEPTH;
+		std::vector<unsigned char> clear_pending;
+		std::vector<RT> sample_colors;
+		std::vector<float> sample_depths;
+		// Samples are only cleared for tiles that get rasterized into
+		std::vector<unsigned char> samples_pending;
+		bool samples_resolved = true;
+		void resolve_samples(size_t tile_id);
+		void fill_tile(size_t tile_id, bool with_samples = true);
+		void fill_tiles(int min_x, int min_y, int max_x, int max_y);
+		template<typename T>
+		bool matches_viewport(const std::shared_ptr<resource<T, Layout>>& target) const;
+		std::vector<raster_triangle<VB>> triangles;
+		std::vector<std::vector<unsigned int>> bins;
+		// Output of the geometry stage, owned by the raster stage once queued
+		struct binned_batch
+		{
+			std::vector<raster_triangle<VB>> triangles;
+			std::vector<std::vector<unsigned int>> bins;
+		};
+		depth_pyramid hierarchical_z;
+		std::vector<std::vector<raster_triangle<VB>>> retained_triangles;
+
+		// Passed in place of a pixel shader to write the visibility buffer
+		struct visibility_writer
+		{
+		};
+
+		float4x4 transform = linalg::identity;
+		vertex_scratch transformed;
+		std::vector<VB> shaded_data;
+		size_t transformed_offset = 0;
+		bool transformed_data_shaded = false;
+
+		template<typename VS>
+		void process_vertices(size_t first_vertex, size_t num_vertexes, const VS& shader);
+		template<typename VS>
+		void assemble_indexed(size_t num_indexes, size_t index_offset, const VS& shader);
+		void transform_positions(size_t num_vertexes);
+		void project_positions(size_t num_vertexes);
+		clip_vertex<VB> transformed_vertex(size_t index) const;
+		template<typename PS>
+		void rasterize_draw(const PS& shader);
+		template<typename PS>
+		void rasterize_triangles(const PS& shader);
+		template<typename PS>
+		void rasterize_bins(
+				const std::vector<raster_triangle<VB>>& batch_triangles,
+				const std::vector<std::vector<unsigned int>>& batch_bins, const PS& shader);
+		template<typename VS, typename PS>
+		void multi_draw_pipelined(const std::vector<draw_range<VB>>& ranges, const VS& in_vertex_shader, const PS& in_pixel_shader);
+		void assemble_triangle(size_t index0, size_t index1, size_t index2);
+		void assemble_triangle(const clip_vertex<VB> (&vertices)[3]);
+		void clip_triangle(const clip_vertex<VB> (&vertices)[3], unsigned int clip_planes);
+		void setup_triangle(const clip_vertex<VB>& vertex0, const clip_vertex<VB>& vertex1, const clip_vertex<VB>& vertex2);
+		float clip_distance(const float4& position, unsigned int plane) const;
+		static constexpr unsigned int CLIP_PLANE_COUNT = 6;
+		void bin_triangles();
+		template<typename PS>
+		void rasterize_triangle(
+				const raster_triangle<VB>& triangle, int rect_min_x, int rect_min_y, int rect_max_x, int rect_max_y,
+				const PS& shader);
+		template<typename PS>
+		void rasterize_small_triangle(
+				const raster_triangle<VB>& triangle, int min_x, int min_y, int max_x, int max_y, const PS& shader);
+		// `inside` spans are known to be covered and skip the edge tests
+		template<typename PS>
+		bool rasterize_span(
+				const raster_triangle<VB>& triangle, int y, int min_x, int max_x, const int64_t (&row)[3],
+				bool depth_accept, bool inside, const PS& shader);
+		template<typename PS>
+		bool rasterize_span_msaa(
+				const raster_triangle<VB>& triangle, int y, int min_x, int max_x, const int64_t (&row)[3],
+				const PS& shader);
+#ifdef __AVX2__
+		template<typename PS>
+		bool rasterize_span_simd(
+				const raster_triangle<VB>& triangle, int y, int min_x, int max_x, const int64_t (&row)[3],
+				bool depth_accept, bool inside, const PS& shader);
+#endif
+		template<typename PS>
+		void shade_pixel(
+				const raster_triangle<VB>& triangle, int x, int y, float w0, float w1, float w2, float depth,
+				const PS& shader);
+		template<typename PS>
+		cg::color run_pixel_shader(
+				const raster_triangle<VB>& triangle, float w0, float w1, float w2, float depth, const PS& shader) const;
+		static VB interpolate(const VB (&data)[3], float w0, float w1, float w2);
+		static VB lerp(const VB& a, const VB& b, float t);
+
+		static int64_t edge_function(int2 a, int2 b, int2 c);
 		bool depth_test(float z, size_t x, size_t y);
+		bool depth_passes(float z, float stored) const;
 	};
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_render_target(
-			std::shared_ptr<resource<RT>> in_render_target,
-			std::shared_ptr<resource<float>> in_depth_buffer)
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_render_target(
+			std::shared_ptr<resource<RT, Layout>> in_render_target,
+			std::shared_ptr<resource<float, Layout>> in_depth_buffer)
 	{
 		render_target = in_render_target;
 		depth_buffer = in_depth_buffer;
+		if (depth_buffer)
+		{
+			const size_t depth_width = depth_buffer->get_stride();
+			hierarchical_z.resize(depth_width, depth_buffer->count() / depth_width, TILE_SIZE);
+		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_viewport(size_t in_width, size_t in_height)
 	{
 		// TODO Lab: 1.02 Implement `set_render_target`, `set_viewport`, `clear_render_target` methods of `cg::renderer::rasterizer` class
 		width = in_width;
-    	height = in_height;
+		height = in_height;
+		set_msaa(msaa);
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::clear_render_target(
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::clear_render_target(
 			const RT& in_clear_value, const float in_depth)
 	{
-		for (size_t i = 0; i < render_target->count(); ++i)
+		clear_value = in_clear_value;
+		clear_depth = in_depth;
+		const size_t tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+		const size_t tiles_y = (height + TILE_SIZE - 1) / TILE_SIZE;
+		clear_pending.assign(tiles_x * tiles_y, 1);
+		samples_pending.assign(msaa ? tiles_x * tiles_y : 0, 1);
+
+		if (depth_buffer)
 		{
-			render_target->item(i) = in_clear_value;
+			hierarchical_z.clear(in_depth);
 		}
+		retained_triangles.clear();
 
-		if (depth_buffer)
+		// Tiles follow the viewport; targets of any other size are cleared eagerly
+		if (!matches_viewport(render_target) || !matches_viewport(depth_buffer) || !matches_viewport(visibility_buffer))
+		{
+			if (msaa)
+			{
+				THROW_ERROR("MSAA needs render targets of the viewport size");
+			}
+			resolve();
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::resolve()
+	{
+		const int num_tiles = static_cast<int>(clear_pending.size());
+		const bool resolve_msaa = msaa && !samples_resolved && render_target;
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile_id = 0; tile_id < num_tiles; ++tile_id)
+		{
+			// A tile without samples holds nothing but the clear value
+			if (resolve_msaa && !samples_pending[tile_id])
+			{
+				resolve_samples(tile_id);
+			}
+			fill_tile(tile_id, false);
+		}
+		samples_resolved = true;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::resolve_samples(size_t tile_id)
+	{
+		const size_t tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+		const size_t min_x = (tile_id % tiles_x) * TILE_SIZE;
+		const size_t min_y = (tile_id / tiles_x) * TILE_SIZE;
+		const size_t max_x = std::min(min_x + TILE_SIZE, width);
+		const size_t max_y = std::min(min_y + TILE_SIZE, height);
+		for (size_t y = min_y; y < max_y; ++y)
+		{
+			for (size_t x = min_x; x < max_x; ++x)
+			{
+				const RT* samples = &sample_colors[(y * width + x) * MSAA_SAMPLES];
+				// Interior pixels have identical samples and skip the round trip through float
+				if (std::all_of(samples + 1, samples + MSAA_SAMPLES, [&](const RT& sample) {
+						return std::memcmp(&sample, samples, sizeof(RT)) == 0;
+					}))
+				{
+					render_target->item(x, y) = samples[0];
+					continue;
+				}
+				float3 sum{0.f, 0.f, 0.f};
+				for (int s = 0; s < MSAA_SAMPLES; ++s)
+				{
+					sum += samples[s].to_float3();
+				}
+				render_target->item(x, y) = RT::from_color(color::from_float3(sum / static_cast<float>(MSAA_SAMPLES)));
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::fill_tile(size_t tile_id, bool with_samples)
+	{
+		const bool fill_targets = tile_id < clear_pending.size() && clear_pending[tile_id];
+		const bool fill_samples = with_samples && tile_id < samples_pending.size() && samples_pending[tile_id];
+		if (!fill_targets && !fill_samples)
+		{
+			return;
+		}
+
+		const size_t tiles_x = (width + TILE_SIZE - 1) / TILE_SIZE;
+		const size_t min_x = (tile_id % tiles_x) * TILE_SIZE;
+		const size_t min_y = (tile_id / tiles_x) * TILE_SIZE;
+		const size_t max_x = std::min(min_x + TILE_SIZE, width);
+		const size_t max_y = std::min(min_y + TILE_SIZE, height);
+		const auto fill = [&](auto& target, const auto& value) {
+			if (!target || target->get_stride() < max_x || target->count() / target->get_stride() < max_y)
+			{
+				return;
+			}
+			// Tiles start at multiples of TILE_SIZE, so each run is contiguous in any layout
+			for (size_t y = min_y; y < max_y; ++y)
+			{
+				for (size_t x = min_x; x < max_x; x += Layout::row_run)
+				{
+					std::fill(&target->item(x, y), &target->item(x, y) + std::min(Layout::row_run, max_x - x), value);
+				}
+			}
+		};
+		if (fill_targets)
+		{
+			clear_pending[tile_id] = 0;
+			fill(render_target, clear_value);
+			fill(depth_buffer, clear_depth);
+			fill(visibility_buffer, INVALID_VISIBILITY_ID);
+		}
+		if (fill_samples)
+		{
+			samples_pending[tile_id] = 0;
+			for (size_t y = min_y; y < max_y; ++y)
+			{
+				const size_t first = (y * width + min_x) * MSAA_SAMPLES;
+				const size_t last = (y * width + max_x) * MSAA_SAMPLES;
+				std::fill(sample_colors.begin() + first, sample_colors.begin() + last, clear_value);
+				std::fill(sample_depths.begin() + first, sample_depths.begin() + last, clear_depth);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::fill_tiles(int min_x, int min_y, int max_x, int max_y)
+	{
+		const int tiles_x = static_cast<int>((width + TILE_SIZE - 1) / TILE_SIZE);
+		const int tiles_y = static_cast<int>((height + TILE_SIZE - 1) / TILE_SIZE);
+		const int first_tile_x = std::max(min_x, 0) / TILE_SIZE;
+		const int first_tile_y = std::max(min_y, 0) / TILE_SIZE;
+		const int last_tile_x = std::min(max_x / TILE_SIZE, tiles_x - 1);
+		const int last_tile_y = std::min(max_y / TILE_SIZE, tiles_y - 1);
+		for (int tile_y = first_tile_y; tile_y <= last_tile_y; ++tile_y)
 		{
-			for (size_t i = 0; i < depth_buffer->count(); ++i)
+			for (int tile_x = first_tile_x; tile_x <= last_tile_x; ++tile_x)
 			{
-				depth_buffer->item(i) = in_depth;
+				fill_tile(static_cast<size_t>(tile_y) * tiles_x + tile_x);
 			}
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_vertex_buffer(
+	template<typename VB, typename RT, typename Layout>
+	template<typename T>
+	inline bool rasterizer<VB, RT, Layout>::matches_viewport(const std::shared_ptr<resource<T, Layout>>& target) const
+	{
+		return !target || (target->get_stride() == width && target->count() == width * height);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_visibility_buffer(
+			std::shared_ptr<resource<unsigned int, Layout>> in_visibility_buffer)
+	{
+		visibility_buffer = in_visibility_buffer;
+		retained_triangles.clear();
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_tile_binning(bool in_tile_binning)
+	{
+		tile_binning = in_tile_binning;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_pipelining(bool in_pipelining)
+	{
+		pipelining = in_pipelining;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_simd(bool in_simd)
+	{
+		simd = in_simd;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_msaa(bool in_msaa)
+	{
+		msaa = in_msaa;
+		const size_t num_samples = msaa ? width * height * MSAA_SAMPLES : 0;
+		sample_colors.resize(num_samples);
+		sample_depths.resize(num_samples);
+		sample_colors.shrink_to_fit();
+		sample_depths.shrink_to_fit();
+		// Samples start out with the last clear value
+		samples_pending.assign(msaa ? clear_pending.size() : 0, 1);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_cull_mode(cull_mode in_cull_mode)
+	{
+		culling = in_cull_mode;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_depth_func(depth_func in_depth_func)
+	{
+		depth_function = in_depth_func;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_vertex_buffer(
 			std::shared_ptr<resource<VB>> in_vertex_buffer)
 	{
 		vertex_buffer = in_vertex_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::set_index_buffer(
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_index_buffer(
 			std::shared_ptr<resource<unsigned int>> in_index_buffer)
 	{
 		index_buffer = in_index_buffer;
 	}
 
-	template<typename VB, typename RT>
-	inline void rasterizer<VB, RT>::draw(size_t num_vertexes, size_t vertex_offset)
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::set_transform(const float4x4& in_transform)
+	{
+		transform = in_transform;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::draw(size_t num_vertexes, size_t vertex_offset)
+	{
+		if (vertex_shader)
+		{
+			draw(num_vertexes, vertex_offset, vertex_shader, pixel_shader);
+		}
+		else
+		{
+			draw(num_vertexes, vertex_offset, nullptr, pixel_shader);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::draw_indexed(size_t num_indexes, size_t index_offset)
 	{
-		for (size_t i = vertex_offset; i < vertex_offset + num_vertexes; i += 3)
+		if (vertex_shader)
 		{
-			vertex vertex0 = vertex_buffer[i];
-			vertex vertex1 = vertex_buffer[i + 1];
-			vertex vertex2 = vertex_buffer[i + 2];
+			draw_indexed(num_indexes, index_offset, vertex_shader, pixel_shader);
+		}
+		else
+		{
+			draw_indexed(num_indexes, index_offset, nullptr, pixel_shader);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename VS, typename PS>
+	inline void rasterizer<VB, RT, Layout>::draw(
+			size_t num_vertexes, size_t vertex_offset, const VS& in_vertex_shader, const PS& in_pixel_shader)
+	{
+		triangles.clear();
+		process_vertices(vertex_offset, num_vertexes, in_vertex_shader);
+		for (size_t i = 0; i + 2 < num_vertexes; i += 3)
+		{
+			assemble_triangle(i, i + 1, i + 2);
+		}
 
-			float4 projected_vertex0 = camera->get_projection_matrix() * camera->get_view_matrix() * float4{vertex0.position, 1.f};
-			float4 projected_vertex1 = camera->get_projection_matrix() * camera->get_view_matrix() * float4{vertex1.position, 1.f};
-			float4 projected_vertex2 = camera->get_projection_matrix() * camera->get_view_matrix() * float4{vertex2.position, 1.f};
+		rasterize_draw(in_pixel_shader);
+	}
 
-			projected_vertex0 /= projected_vertex0.w;
-			projected_vertex1 /= projected_vertex1.w;
-			projected_vertex2 /= projected_vertex2.w;
+	template<typename VB, typename RT, typename Layout>
+	template<typename VS, typename PS>
+	inline void rasterizer<VB, RT, Layout>::draw_indexed(
+			size_t num_indexes, size_t index_offset, const VS& in_vertex_shader, const PS& in_pixel_shader)
+	{
+		triangles.clear();
+		assemble_indexed(num_indexes, index_offset, in_vertex_shader);
+		rasterize_draw(in_pixel_shader);
+	}
 
-			int2 screen_vertex0 = {
-				static_cast<int>((projected_vertex0.x + 1.f) * 0.5f * width),
-				static_cast<int>((1.f - projected_vertex0.y) * 0.5f * height)
-			};
-			int2 screen_vertex1 = {
-				static_cast<int>((projected_vertex1.x + 1.f) * 0.5f * width),
-				static_cast<int>((1.f - projected_vertex1.y) * 0.5f * height)
-			};
-			int2 screen_vertex2 = {
-				static_cast<int>((projected_vertex2.x + 1.f) * 0.5f * width),
-				static_cast<int>((1.f - projected_vertex2.y) * 0.5f * height)
-			};
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::draw_instanced(
+			size_t num_indexes, size_t index_offset, std::shared_ptr<resource<float4x4>> instance_transforms)
+	{
+		draw_instanced(num_indexes, index_offset, instance_transforms, pixel_shader);
+	}
 
-			int min_x = std::min({screen_vertex0.x, screen_vertex1.x, screen_vertex2.x});
-			int max_x = std::max({screen_vertex0.x, screen_vertex1.x, screen_vertex2.x});
-			int min_y = std::min({screen_vertex0.y, screen_vertex1.y, screen_vertex2.y});
-			int max_y = std::max({screen_vertex0.y, screen_vertex1.y, screen_vertex2.y});
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::draw_instanced(
+			size_t num_indexes, size_t index_offset, std::shared_ptr<resource<float4x4>> instance_transforms,
+			const PS& in_pixel_shader)
+	{
+		triangles.clear();
+		const float4x4 view_projection = transform;
+		for (size_t instance = 0; instance < instance_transforms->count(); ++instance)
+		{
+			transform = mul(view_projection, instance_transforms->item(instance));
+			assemble_indexed(num_indexes, index_offset, nullptr);
+		}
+		transform = view_projection;
+
+		rasterize_draw(in_pixel_shader);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::multi_draw(const std::vector<draw_range<VB>>& ranges)
+	{
+		if (vertex_shader)
+		{
+			multi_draw(ranges, vertex_shader, pixel_shader);
+		}
+		else
+		{
+			multi_draw(ranges, nullptr, pixel_shader);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename VS, typename PS>
+	inline void rasterizer<VB, RT, Layout>::multi_draw(
+			const std::vector<draw_range<VB>>& ranges, const VS& in_vertex_shader, const PS& in_pixel_shader)
+	{
+		if (pipelining && tile_binning && !visibility_buffer && ranges.size() > 1)
+		{
+			multi_draw_pipelined(ranges, in_vertex_shader, in_pixel_shader);
+			return;
+		}
 
-			for (int x = min_x; x <= max_x; ++x)
+		triangles.clear();
+		const auto bound_vertex_buffer = vertex_buffer;
+		const auto bound_index_buffer = index_buffer;
+		for (const auto& range: ranges)
+		{
+			vertex_buffer = range.vertex_buffer;
+			index_buffer = range.index_buffer;
+			assemble_indexed(range.num_indexes, range.index_offset, in_vertex_shader);
+		}
+		vertex_buffer = bound_vertex_buffer;
+		index_buffer = bound_index_buffer;
+
+		rasterize_draw(in_pixel_shader);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename VS, typename PS>
+	inline void rasterizer<VB, RT, Layout>::multi_draw_pipelined(
+			const std::vector<draw_range<VB>>& ranges, const VS& in_vertex_shader, const PS& in_pixel_shader)
+	{
+		// Filled batches go to the raster stage, drained ones come back to reuse their allocations
+		cg::utils::spsc_queue<binned_batch> filled(PIPELINE_DEPTH);
+		cg::utils::spsc_queue<binned_batch> drained(PIPELINE_DEPTH);
+		std::atomic<bool> stop{false};
+		std::exception_ptr geometry_error;
+		std::exception_ptr raster_error;
+
+		const auto bound_vertex_buffer = vertex_buffer;
+		const auto bound_index_buffer = index_buffer;
+		// Only this thread touches the vertex scratch, `triangles` and `bins` until it is joined
+		std::thread geometry([&]() {
+			try
 			{
-				for (int y = min_y; y <= max_y; ++y)
+				for (const auto& range: ranges)
 				{
-					int2 pixel{x, y};
-					float area = edge_function(screen_vertex0, screen_vertex1, screen_vertex2);
-					float w0 = edge_function(screen_vertex1, screen_vertex2, pixel) / area;
-					float w1 = edge_function(screen_vertex2, screen_vertex0, pixel) / area;
-					float w2 = edge_function(screen_vertex0, screen_vertex1, pixel) / area;
+					binned_batch batch;
+					drained.try_pop(batch);
+					triangles.swap(batch.triangles);
+					bins.swap(batch.bins);
 
-					if (w0 >= 0 && w1 >= 0 && w2 >= 0)
-					{
-						float depth = w0 * projected_vertex0.z + w1 * projected_vertex1.z + w2 * projected_vertex2.z;
+					triangles.clear();
+					vertex_buffer = range.vertex_buffer;
+					index_buffer = range.index_buffer;
+					assemble_indexed(range.num_indexes, range.index_offset, in_vertex_shader);
+					bin_triangles();
 
-						if (depth < depth_buffer->item(x, y))
+					triangles.swap(batch.triangles);
+					bins.swap(batch.bins);
+					while (!filled.try_push(batch))
+					{
+						if (stop)
 						{
-							depth_buffer->item(x, y) = depth;
-
-							float3 color = w0 * vertex0.color + w1 * vertex1.color + w2 * vertex2.color;
-							render_target->item(x, y) = RT::from_float3(color);
+							return;
 						}
+						std::this_thread::yield();
 					}
 				}
 			}
+			catch (...)
+			{
+				geometry_error = std::current_exception();
+				stop = true;
+			}
+		});
+
+		try
+		{
+			samples_resolved = samples_resolved && !msaa;
+			binned_batch batch;
+			for (size_t rasterized = 0; rasterized < ranges.size() && !stop;)
+			{
+				if (!filled.try_pop(batch))
+				{
+					std::this_thread::yield();
+					continue;
+				}
+				rasterize_bins(batch.triangles, batch.bins, in_pixel_shader);
+				drained.try_push(batch);
+				++rasterized;
+			}
+		}
+		catch (...)
+		{
+			raster_error = std::current_exception();
+		}
+		stop = true;
+		geometry.join();
+
+		vertex_buffer = bound_vertex_buffer;
+		index_buffer = bound_index_buffer;
+		triangles.clear();
+		if (geometry_error)
+		{
+			std::rethrow_exception(geometry_error);
+		}
+		if (raster_error)
+		{
+			std::rethrow_exception(raster_error);
 		}
 	}
 
-	template<typename VB, typename RT>
-	inline int
-	rasterizer<VB, RT>::edge_function(int2 a, int2 b, int2 c)
+	template<typename VB, typename RT, typename Layout>
+	template<typename VS>
+	inline void rasterizer<VB, RT, Layout>::assemble_indexed(size_t num_indexes, size_t index_offset, const VS& shader)
 	{
-		// TODO Lab: 1.05 Implement `cg::renderer::rasterizer::edge_function` method
-		return (c.x - a.x) * (b.y - a.y) - (c.y - a.y) * (b.x - a.x);
+		if (num_indexes == 0)
+		{
+			return;
+		}
+
+		unsigned int min_index = std::numeric_limits<unsigned int>::max();
+		unsigned int max_index = 0;
+		for (size_t i = index_offset; i < index_offset + num_indexes; ++i)
+		{
+			min_index = std::min(min_index, index_buffer->item(i));
+			max_index = std::max(max_index, index_buffer->item(i));
+		}
+		process_vertices(min_index, max_index - min_index + 1, shader);
+
+		for (size_t i = index_offset; i + 2 < index_offset + num_indexes; i += 3)
+		{
+			assemble_triangle(
+					index_buffer->item(i) - min_index,
+					index_buffer->item(i + 1) - min_index,
+					index_buffer->item(i + 2) - min_index);
+		}
 	}
 
-	template<typename VB, typename RT>
-	inline bool rasterizer<VB, RT>::depth_test(float z, size_t x, size_t y)
+	template<typename VB, typename RT, typename Layout>
+	template<typename VS>
+	inline void rasterizer<VB, RT, Layout>::process_vertices(size_t first_vertex, size_t num_vertexes, const VS& shader)
 	{
-		if (!depth_buffer)
+		transformed_offset = first_vertex;
+		transformed.resize(num_vertexes);
+		transformed_data_shaded = !std::is_same_v<VS, std::nullptr_t>;
+
+		if constexpr (!std::is_same_v<VS, std::nullptr_t>)
 		{
-			return true;
+			shaded_data.resize(num_vertexes);
+			for (size_t i = 0; i < num_vertexes; ++i)
+			{
+				const VB& vertex = vertex_buffer->item(first_vertex + i);
+				auto [clip_position, vertex_data] = shader(float4{vertex.position, 1.f}, vertex);
+				transformed.clip_x[i] = clip_position.x;
+				transformed.clip_y[i] = clip_position.y;
+				transformed.clip_z[i] = clip_position.z;
+				transformed.clip_w[i] = clip_position.w;
+				shaded_data[i] = vertex_data;
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < num_vertexes; ++i)
+			{
+				const float3& position = vertex_buffer->item(first_vertex + i).position;
+				transformed.position_x[i] = position.x;
+				transformed.position_y[i] = position.y;
+				transformed.position_z[i] = position.z;
+			}
+			transform_positions(num_vertexes);
+		}
+
+		project_positions(num_vertexes);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::transform_positions(size_t num_vertexes)
+	{
+		// Same operation order as mul(transform, float4{position, 1}) so both vertex paths agree
+#ifdef __AVX2__
+		__m256 m[4][4];
+		for (int column = 0; column < 4; ++column)
+		{
+			for (int row = 0; row < 4; ++row)
+			{
+				m[column][row] = _mm256_set1_ps(transform[column][row]);
+			}
+		}
+		float* clip[4] = {transformed.clip_x.data(), transformed.clip_y.data(), transformed.clip_z.data(), transformed.clip_w.data()};
+		for (size_t i = 0; i < num_vertexes; i += vertex_scratch::BATCH_SIZE)
+		{
+			const __m256 x = _mm256_loadu_ps(transformed.position_x.data() + i);
+			const __m256 y = _mm256_loadu_ps(transformed.position_y.data() + i);
+			const __m256 z = _mm256_loadu_ps(transformed.position_z.data() + i);
+			for (int row = 0; row < 4; ++row)
+			{
+				__m256 result = _mm256_mul_ps(m[0][row], x);
+				result = _mm256_add_ps(result, _mm256_mul_ps(m[1][row], y));
+				result = _mm256_add_ps(result, _mm256_mul_ps(m[2][row], z));
+				result = _mm256_add_ps(result, m[3][row]);
+				_mm256_storeu_ps(clip[row] + i, result);
+			}
+		}
+#else
+		for (size_t i = 0; i < num_vertexes; ++i)
+		{
+			const float4 clip_position = mul(
+					transform,
+					float4{transformed.position_x[i], transformed.position_y[i], transformed.position_z[i], 1.f});
+			transformed.clip_x[i] = clip_position.x;
+			transformed.clip_y[i] = clip_position.y;
+			transformed.clip_z[i] = clip_position.z;
+			transformed.clip_w[i] = clip_position.w;
+		}
+#endif
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::project_positions(size_t num_vertexes)
+	{
+		// Perspective divide and viewport transform, rounded to nearest like the scalar setup path.
+		// Lanes with w <= 0 produce garbage that is never read: such vertices are always clipped away.
+		const float scale_x = 0.5f * width * SUBPIXEL_ONE;
+		const float scale_y = 0.5f * height * SUBPIXEL_ONE;
+#ifdef __AVX2__
+		const __m256 one = _mm256_set1_ps(1.f);
+		const __m256 max_screen = _mm256_set1_ps(static_cast<float>(std::numeric_limits<int>::max() / 2));
+		for (size_t i = 0; i < num_vertexes; i += vertex_scratch::BATCH_SIZE)
+		{
+			const __m256 w = _mm256_loadu_ps(transformed.clip_w.data() + i);
+			const __m256 x = _mm256_div_ps(_mm256_loadu_ps(transformed.clip_x.data() + i), w);
+			const __m256 y = _mm256_div_ps(_mm256_loadu_ps(transformed.clip_y.data() + i), w);
+			const __m256 z = _mm256_div_ps(_mm256_loadu_ps(transformed.clip_z.data() + i), w);
+			__m256 screen_x = _mm256_mul_ps(_mm256_add_ps(x, one), _mm256_set1_ps(scale_x));
+			__m256 screen_y = _mm256_mul_ps(_mm256_sub_ps(one, y), _mm256_set1_ps(scale_y));
+			screen_x = _mm256_max_ps(_mm256_min_ps(screen_x, max_screen), _mm256_sub_ps(_mm256_setzero_ps(), max_screen));
+			screen_y = _mm256_max_ps(_mm256_min_ps(screen_y, max_screen), _mm256_sub_ps(_mm256_setzero_ps(), max_screen));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(transformed.screen_x.data() + i), _mm256_cvtps_epi32(screen_x));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(transformed.screen_y.data() + i), _mm256_cvtps_epi32(screen_y));
+			_mm256_storeu_ps(transformed.depth.data() + i, z);
+		}
+#else
+		for (size_t i = 0; i < num_vertexes; ++i)
+		{
+			const float w = transformed.clip_w[i];
+			if (w <= 0.f)
+			{
+				continue;
+			}
+			const float max_screen = static_cast<float>(std::numeric_limits<int>::max() / 2);
+			const float screen_x = std::clamp((transformed.clip_x[i] / w + 1.f) * scale_x, -max_screen, max_screen);
+			const float screen_y = std::clamp((1.f - transformed.clip_y[i] / w) * scale_y, -max_screen, max_screen);
+			transformed.screen_x[i] = static_cast<int>(std::lrint(screen_x));
+			transformed.screen_y[i] = static_cast<int>(std::lrint(screen_y));
+			transformed.depth[i] = transformed.clip_z[i] / w;
+		}
+#endif
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline clip_vertex<VB> rasterizer<VB, RT, Layout>::transformed_vertex(size_t index) const
+	{
+		clip_vertex<VB> vertex{
+				float4{transformed.clip_x[index], transformed.clip_y[index], transformed.clip_z[index], transformed.clip_w[index]},
+				transformed_data_shaded ? shaded_data[index] : vertex_buffer->item(transformed_offset + index)};
+		vertex.projected = vertex.position.w > 0.f;
+		vertex.screen = int2{transformed.screen_x[index], transformed.screen_y[index]};
+		vertex.z = transformed.depth[index];
+		return vertex;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::rasterize_draw(const PS& shader)
+	{
+		if (!visibility_buffer)
+		{
+			rasterize_triangles(shader);
+			return;
+		}
+
+		if (msaa)
+		{
+			THROW_ERROR("The visibility buffer does not support MSAA");
+		}
+		if (retained_triangles.size() > (INVALID_VISIBILITY_ID >> TRIANGLE_ID_BITS) - 1)
+		{
+			THROW_ERROR("Too many draws for the visibility buffer");
+		}
+		if (triangles.size() > TRIANGLE_ID_MASK + size_t{1})
+		{
+			THROW_ERROR("Too many triangles in one draw for the visibility buffer");
+		}
+		rasterize_triangles(visibility_writer{});
+		retained_triangles.push_back(std::move(triangles));
+		triangles.clear();
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::resolve_visibility()
+	{
+		resolve_visibility(pixel_shader);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::resolve_visibility(const PS& in_pixel_shader)
+	{
+		resolve();
+
+		const int resolve_width = static_cast<int>(width);
+		const int resolve_height = static_cast<int>(height);
+		#pragma omp parallel for schedule(dynamic)
+		for (int y = 0; y < resolve_height; ++y)
+		{
+			for (int x = 0; x < resolve_width; ++x)
+			{
+				const unsigned int id = visibility_buffer->item(x, y);
+				if (id == INVALID_VISIBILITY_ID)
+				{
+					continue;
+				}
+				const raster_triangle<VB>& triangle = retained_triangles[id >> TRIANGLE_ID_BITS][id & TRIANGLE_ID_MASK];
+
+				// Same barycentrics the raster loop derives from the stepped edge functions
+				float w[3];
+				for (int e = 0; e < 3; ++e)
+				{
+					const int64_t edge = triangle.edge_origin[e] + x * triangle.edge_step_x[e] + y * triangle.edge_step_y[e];
+					w[e] = static_cast<float>(edge - triangle.edge_bias[e]) * triangle.inv_area;
+				}
+				const float depth = w[0] * triangle.z[0] + w[1] * triangle.z[1] + w[2] * triangle.z[2];
+				shade_pixel(triangle, x, y, w[0], w[1], w[2], depth, in_pixel_shader);
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::rasterize_triangles(const PS& shader)
+	{
+		samples_resolved = samples_resolved && !msaa;
+		if (!tile_binning)
+		{
+			for (const auto& triangle: triangles)
+			{
+				if (triangle.max_x < 0 || triangle.max_y < 0)
+				{
+					continue;
+				}
+				fill_tiles(triangle.min_x, triangle.min_y, triangle.max_x, triangle.max_y);
+				rasterize_triangle(triangle, 0, 0, static_cast<int>(width), static_cast<int>(height), shader);
+			}
+			return;
+		}
+
+		bin_triangles();
+		rasterize_bins(triangles, bins, shader);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::rasterize_bins(
+			const std::vector<raster_triangle<VB>>& batch_triangles,
+			const std::vector<std::vector<unsigned int>>& batch_bins, const PS& shader)
+	{
+		// Tile depth bounds are taken here rather than while binning, so that
+		// binning never reads depth another stage is still writing
+		if (depth_buffer)
+		{
+			hierarchical_z.refresh_tiles(*depth_buffer);
+		}
+
+		const int tiles_x = static_cast<int>((width + TILE_SIZE - 1) / TILE_SIZE);
+		const int num_tiles = static_cast<int>(batch_bins.size());
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile_id = 0; tile_id < num_tiles; ++tile_id)
+		{
+			const int tile_min_x = (tile_id % tiles_x) * TILE_SIZE;
+			const int tile_min_y = (tile_id / tiles_x) * TILE_SIZE;
+			const int tile_max_x = std::min(tile_min_x + TILE_SIZE, static_cast<int>(width));
+			const int tile_max_y = std::min(tile_min_y + TILE_SIZE, static_cast<int>(height));
+
+			bool filled = false;
+			for (const unsigned int triangle_id: batch_bins[tile_id])
+			{
+				const raster_triangle<VB>& triangle = batch_triangles[triangle_id];
+				// The whole triangle is behind everything already in this tile. Equal depths
+				// still pass less_equal and equal, e.g. the shading pass after a depth prepass.
+				if (depth_buffer)
+				{
+					const float tile_max = hierarchical_z.tile_max[tile_id];
+					if (depth_function == depth_func::less ? triangle.min_z >= tile_max : triangle.min_z > tile_max)
+					{
+						continue;
+					}
+				}
+				if (!filled)
+				{
+					fill_tile(tile_id);
+					filled = true;
+				}
+				rasterize_triangle(triangle, tile_min_x, tile_min_y, tile_max_x, tile_max_y, shader);
+			}
+		}
+	}
+
+	// Clip planes are numbered near, far, then the guard band left, right, bottom, top.
+	// The distance is positive on the visible side.
+	template<typename VB, typename RT, typename Layout>
+	inline float rasterizer<VB, RT, Layout>::clip_distance(const float4& position, unsigned int plane) const
+	{
+		const float guard_x = 1.f + 2.f * GUARD_BAND / width;
+		const float guard_y = 1.f + 2.f * GUARD_BAND / height;
+		switch (plane)
+		{
+			case 0:
+				return position.z;
+			case 1:
+				return position.w - position.z;
+			case 2:
+				return position.x + guard_x * position.w;
+			case 3:
+				return guard_x * position.w - position.x;
+			case 4:
+				return position.y + guard_y * position.w;
+			default:
+				return guard_y * position.w - position.y;
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::assemble_triangle(size_t index0, size_t index1, size_t index2)
+	{
+		const clip_vertex<VB> vertices[3] = {
+				transformed_vertex(index0),
+				transformed_vertex(index1),
+				transformed_vertex(index2)};
+		assemble_triangle(vertices);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::assemble_triangle(const clip_vertex<VB> (&vertices)[3])
+	{
+		// Trivially reject triangles entirely outside the view volume
+		const auto outside = [&](auto test) {
+			return test(vertices[0].position) && test(vertices[1].position) && test(vertices[2].position);
+		};
+		if (outside([](const float4& p) { return p.x < -p.w; }) ||
+			outside([](const float4& p) { return p.x > p.w; }) ||
+			outside([](const float4& p) { return p.y < -p.w; }) ||
+			outside([](const float4& p) { return p.y > p.w; }) ||
+			outside([](const float4& p) { return p.z < 0.f; }) ||
+			outside([](const float4& p) { return p.z > p.w; }))
+		{
+			return;
+		}
+
+		unsigned int clip_planes = 0;
+		for (unsigned int plane = 0; plane < CLIP_PLANE_COUNT; ++plane)
+		{
+			for (const auto& vertex: vertices)
+			{
+				if (clip_distance(vertex.position, plane) < 0.f)
+				{
+					clip_planes |= 1u << plane;
+				}
+			}
+		}
+
+		if (clip_planes == 0)
+		{
+			setup_triangle(vertices[0], vertices[1], vertices[2]);
+		}
+		else
+		{
+			clip_triangle(vertices, clip_planes);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::clip_triangle(const clip_vertex<VB> (&vertices)[3], unsigned int clip_planes)
+	{
+		// Sutherland-Hodgman against each crossed plane; a triangle gains at most one vertex per plane
+		constexpr size_t max_vertices = 3 + CLIP_PLANE_COUNT;
+		clip_vertex<VB> polygon[max_vertices];
+		clip_vertex<VB> clipped[max_vertices];
+		size_t count = 3;
+		std::copy(std::begin(vertices), std::end(vertices), polygon);
+
+		for (unsigned int plane = 0; plane < CLIP_PLANE_COUNT && count >= 3; ++plane)
+		{
+			if (!(clip_planes & (1u << plane)))
+			{
+				continue;
+			}
+
+			size_t clipped_count = 0;
+			for (size_t i = 0; i < count; ++i)
+			{
+				const clip_vertex<VB>& current = polygon[i];
+				const clip_vertex<VB>& next = polygon[(i + 1) % count];
+				const float current_distance = clip_distance(current.position, plane);
+				const float next_distance = clip_distance(next.position, plane);
+
+				if (current_distance >= 0.f)
+				{
+					clipped[clipped_count++] = current;
+				}
+				if ((current_distance >= 0.f) != (next_distance >= 0.f))
+				{
+					const float t = current_distance / (current_distance - next_distance);
+					clipped[clipped_count++] = clip_vertex<VB>{
+							current.position + t * (next.position - current.position),
+							lerp(current.data, next.data, t)};
+				}
+			}
+			std::copy(clipped, clipped + clipped_count, polygon);
+			count = clipped_count;
+		}
+
+		for (size_t i = 1; i + 1 < count; ++i)
+		{
+			setup_triangle(polygon[0], polygon[i], polygon[i + 1]);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::setup_triangle(
+			const clip_vertex<VB>& vertex0, const clip_vertex<VB>& vertex1, const clip_vertex<VB>& vertex2)
+	{
+		raster_triangle<VB> triangle;
+		const clip_vertex<VB>* vertices[3] = {&vertex0, &vertex1, &vertex2};
+		for (int v = 0; v < 3; ++v)
+		{
+			if (vertices[v]->projected)
+			{
+				triangle.screen[v] = vertices[v]->screen;
+				triangle.z[v] = vertices[v]->z;
+			}
+			else
+			{
+				float4 projected = vertices[v]->position / vertices[v]->position.w;
+				triangle.screen[v] = int2{
+						static_cast<int>(std::lrint((projected.x + 1.f) * (0.5f * width * SUBPIXEL_ONE))),
+						static_cast<int>(std::lrint((1.f - projected.y) * (0.5f * height * SUBPIXEL_ONE)))};
+				triangle.z[v] = projected.z;
+			}
+			triangle.data[v] = vertices[v]->data;
+			triangle.inv_w[v] = 1.f / vertices[v]->position.w;
+		}
+		triangle.min_z = std::min({triangle.z[0], triangle.z[1], triangle.z[2]});
+		triangle.max_z = std::max({triangle.z[0], triangle.z[1], triangle.z[2]});
+
+		int64_t area = edge_function(triangle.screen[0], triangle.screen[1], triangle.screen[2]);
+		if (area == 0 ||
+			(culling == cull_mode::back && area < 0) ||
+			(culling == cull_mode::front && area > 0))
+		{
+			return;
+		}
+		if (area < 0)
+		{
+			// Keep the interior on the positive side of every edge
+			std::swap(triangle.screen[1], triangle.screen[2]);
+			std::swap(triangle.z[1], triangle.z[2]);
+			std::swap(triangle.data[1], triangle.data[2]);
+			std::swap(triangle.inv_w[1], triangle.inv_w[2]);
+			area = -area;
+		}
+		triangle.inv_area = 1.f / static_cast<float>(area);
+
+		// Pixel x covers the sample at x * SUBPIXEL_ONE + SUBPIXEL_ONE / 2,
+		// or the MSAA samples spread up to 6 subpixels around it
+		const int half = SUBPIXEL_ONE / 2;
+		const int spread = msaa ? 6 : 0;
+		const int min_fx = std::min({triangle.screen[0].x, triangle.screen[1].x, triangle.screen[2].x});
+		const int max_fx = std::max({triangle.screen[0].x, triangle.screen[1].x, triangle.screen[2].x});
+		const int min_fy = std::min({triangle.screen[0].y, triangle.screen[1].y, triangle.screen[2].y});
+		const int max_fy = std::max({triangle.screen[0].y, triangle.screen[1].y, triangle.screen[2].y});
+		triangle.min_x = (min_fx - half - spread + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS;
+		triangle.max_x = (max_fx - half + spread) >> SUBPIXEL_BITS;
+		triangle.min_y = (min_fy - half - spread + SUBPIXEL_ONE - 1) >> SUBPIXEL_BITS;
+		triangle.max_y = (max_fy - half + spread) >> SUBPIXEL_BITS;
+		if (triangle.min_x > triangle.max_x || triangle.min_y > triangle.max_y)
+		{
+			return;
+		}
+
+		for (int e = 0; e < 3; ++e)
+		{
+			const int2 a = triangle.screen[(e + 1) % 3];
+			const int2 b = triangle.screen[(e + 2) % 3];
+			const int64_t step_x = b.y - a.y;
+			const int64_t step_y = a.x - b.x;
+			// Pixels exactly on an edge belong to the triangle only for top and left edges
+			const bool top_left = step_x > 0 || (step_x == 0 && step_y > 0);
+
+			triangle.edge_bias[e] = top_left ? 0 : -1;
+			triangle.edge_origin[e] = edge_function(a, b, int2{half, half}) + triangle.edge_bias[e];
+			triangle.edge_step_x[e] = step_x * SUBPIXEL_ONE;
+			triangle.edge_step_y[e] = step_y * SUBPIXEL_ONE;
+		}
+		triangle.simd_steps = std::max({std::abs(triangle.edge_step_x[0]), std::abs(triangle.edge_step_x[1]),
+										std::abs(triangle.edge_step_x[2])}) <= (int64_t{1} << 24);
+
+		// Dense meshes are mostly pixel-sized triangles: test their few pixel centers
+		// now and drop the ones covering none. MSAA samples keep the general path.
+		triangle.small_coverage = 0;
+		if (!msaa && triangle.max_x - triangle.min_x <= 1 && triangle.max_y - triangle.min_y <= 1)
+		{
+			for (int y = triangle.min_y; y <= triangle.max_y; ++y)
+			{
+				for (int x = triangle.min_x; x <= triangle.max_x; ++x)
+				{
+					int64_t edge[3];
+					for (int e = 0; e < 3; ++e)
+					{
+						edge[e] = triangle.edge_origin[e] + x * triangle.edge_step_x[e] + y * triangle.edge_step_y[e];
+					}
+					if ((edge[0] | edge[1] | edge[2]) >= 0)
+					{
+						triangle.small_coverage |= 1u << ((y - triangle.min_y) * 2 + x - triangle.min_x);
+					}
+				}
+			}
+			if (!triangle.small_coverage)
+			{
+				return;
+			}
+		}
+
+		triangle.id = static_cast<unsigned int>(retained_triangles.size() << TRIANGLE_ID_BITS) |
+					  static_cast<unsigned int>(triangles.size() & TRIANGLE_ID_MASK);
+		triangles.push_back(triangle);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void rasterizer<VB, RT, Layout>::bin_triangles()
+	{
+		const int tiles_x = static_cast<int>((width + TILE_SIZE - 1) / TILE_SIZE);
+		const int tiles_y = static_cast<int>((height + TILE_SIZE - 1) / TILE_SIZE);
+
+		bins.resize(static_cast<size_t>(tiles_x) * tiles_y);
+		for (auto& bin: bins)
+		{
+			bin.clear();
+		}
+
+		for (size_t i = 0; i < triangles.size(); ++i)
+		{
+			const auto& triangle = triangles[i];
+			if (triangle.max_x < 0 || triangle.max_y < 0 ||
+				triangle.min_x >= static_cast<int>(width) || triangle.min_y >= static_cast<int>(height))
+			{
+				continue;
+			}
+
+			const int first_tile_x = std::max(triangle.min_x, 0) / TILE_SIZE;
+			const int last_tile_x = std::min(triangle.max_x, static_cast<int>(width) - 1) / TILE_SIZE;
+			const int first_tile_y = std::max(triangle.min_y, 0) / TILE_SIZE;
+			const int last_tile_y = std::min(triangle.max_y, static_cast<int>(height) - 1) / TILE_SIZE;
+
+			for (int tile_y = first_tile_y; tile_y <= last_tile_y; ++tile_y)
+			{
+				for (int tile_x = first_tile_x; tile_x <= last_tile_x; ++tile_x)
+				{
+					bins[static_cast<size_t>(tile_y) * tiles_x + tile_x].push_back(static_cast<unsigned int>(i));
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::rasterize_triangle(
+			const raster_triangle<VB>& triangle, int rect_min_x, int rect_min_y, int rect_max_x, int rect_max_y,
+			const PS& shader)
+	{
+		// The rectangle is half-open, so adjacent tiles never touch the same pixel
+		const int min_x = std::max(triangle.min_x, rect_min_x);
+		const int max_x = std::min(triangle.max_x, rect_max_x - 1);
+		const int min_y = std::max(triangle.min_y, rect_min_y);
+		const int max_y = std::min(triangle.max_y, rect_max_y - 1);
+
+		if (min_x > max_x || min_y > max_y)
+		{
+			return;
+		}
+		if (triangle.small_coverage)
+		{
+			rasterize_small_triangle(triangle, min_x, min_y, max_x, max_y, shader);
+			return;
+		}
+
+		// MSAA samples sit up to 6 subpixels from the pixel center, which moves edge values by at most this
+		int64_t sample_spread[3] = {};
+		if (msaa)
+		{
+			for (int e = 0; e < 3; ++e)
+			{
+				sample_spread[e] = 6 * (std::abs(triangle.edge_step_x[e]) + std::abs(triangle.edge_step_y[e])) / SUBPIXEL_ONE + 1;
+			}
+		}
+
+		// Walk the bounding box in 8x8 blocks. Each block is first classified against the
+		// edges: blocks outside any edge are skipped and blocks inside all of them skip
+		// per-pixel coverage tests. Then it can be rejected or accepted by the depth pyramid.
+		constexpr int block_size = depth_pyramid::BLOCK_SIZE;
+		for (int block_y = min_y - min_y % block_size; block_y <= max_y; block_y += block_size)
+		{
+			for (int block_x = min_x - min_x % block_size; block_x <= max_x; block_x += block_size)
+			{
+				const int span_min_x = std::max(block_x, min_x);
+				const int span_max_x = std::min(block_x + block_size - 1, max_x);
+				const int span_min_y = std::max(block_y, min_y);
+				const int span_max_y = std::min(block_y + block_size - 1, max_y);
+
+				// Edge functions are linear, so their extremes over the block are at the corners
+				bool outside = false;
+				bool inside = !msaa;
+				for (int e = 0; e < 3; ++e)
+				{
+					const int64_t step_x = triangle.edge_step_x[e];
+					const int64_t step_y = triangle.edge_step_y[e];
+					const int64_t edge_max = triangle.edge_origin[e] +
+											 (step_x > 0 ? span_max_x : span_min_x) * step_x +
+											 (step_y > 0 ? span_max_y : span_min_y) * step_y;
+					const int64_t edge_min = triangle.edge_origin[e] +
+											 (step_x > 0 ? span_min_x : span_max_x) * step_x +
+											 (step_y > 0 ? span_min_y : span_max_y) * step_y;
+					outside |= edge_max + sample_spread[e] < 0;
+					inside &= edge_min >= 0;
+				}
+				if (outside)
+				{
+					continue;
+				}
+
+				bool depth_accept = false;
+				if (depth_buffer)
+				{
+					const size_t block = hierarchical_z.block_index(block_x, block_y);
+					const float block_min = hierarchical_z.block_min[block];
+					const float block_max = hierarchical_z.block_max[block];
+					// With MSAA the depth buffer only holds the farthest sample of each
+					// pixel, so block_min bounds nothing and only rejection by block_max stays
+					if (depth_function == depth_func::less)
+					{
+						if (triangle.min_z >= block_max)
+						{
+							continue;
+						}
+						depth_accept = !msaa && triangle.max_z < block_min;
+					}
+					else if (triangle.min_z > block_max ||
+							 (depth_function == depth_func::equal && !msaa && triangle.max_z < block_min))
+					{
+						continue;
+					}
+				}
+
+				int64_t row[3];
+				for (int e = 0; e < 3; ++e)
+				{
+					row[e] = triangle.edge_origin[e] + span_min_x * triangle.edge_step_x[e] +
+							 span_min_y * triangle.edge_step_y[e];
+				}
+
+				bool written = false;
+				for (int y = span_min_y; y <= span_max_y; ++y)
+				{
+					if (msaa)
+					{
+						written |= rasterize_span_msaa(triangle, y, span_min_x, span_max_x, row, shader);
+					}
+					else
+#ifdef __AVX2__
+					// Spans stay inside an 8-aligned block, which is contiguous unless the layout swizzles rows
+					if (Layout::row_run >= 8 && simd && triangle.simd_steps)
+					{
+						written |= rasterize_span_simd(triangle, y, span_min_x, span_max_x, row, depth_accept, inside, shader);
+					}
+					else
+#endif
+					{
+						written |= rasterize_span(triangle, y, span_min_x, span_max_x, row, depth_accept, inside, shader);
+					}
+					row[0] += triangle.edge_step_y[0];
+					row[1] += triangle.edge_step_y[1];
+					row[2] += triangle.edge_step_y[2];
+				}
+
+				if (written && depth_buffer)
+				{
+					hierarchical_z.update_block(*depth_buffer, block_x, block_y);
+				}
+			}
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::rasterize_small_triangle(
+			const raster_triangle<VB>& triangle, int min_x, int min_y, int max_x, int max_y, const PS& shader)
+	{
+		// Coverage is known, so only the covered pixels inside the rectangle are visited
+		for (int bit = 0; bit < 4; ++bit)
+		{
+			const int x = triangle.min_x + (bit & 1);
+			const int y = triangle.min_y + (bit >> 1);
+			if (!(triangle.small_coverage & (1u << bit)) || x < min_x || x > max_x || y < min_y || y > max_y)
+			{
+				continue;
+			}
+
+			float w[3];
+			for (int e = 0; e < 3; ++e)
+			{
+				const int64_t edge = triangle.edge_origin[e] + x * triangle.edge_step_x[e] + y * triangle.edge_step_y[e];
+				w[e] = static_cast<float>(edge - triangle.edge_bias[e]) * triangle.inv_area;
+			}
+			const float depth = w[0] * triangle.z[0] + w[1] * triangle.z[1] + w[2] * triangle.z[2];
+			if (!depth_test(depth, x, y))
+			{
+				continue;
+			}
+			if (depth_buffer)
+			{
+				depth_buffer->item(x, y) = depth;
+				hierarchical_z.update_pixel(x, y, depth);
+			}
+			shade_pixel(triangle, x, y, w[0], w[1], w[2], depth, shader);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline bool rasterizer<VB, RT, Layout>::rasterize_span(
+			const raster_triangle<VB>& triangle, int y, int min_x, int max_x, const int64_t (&row)[3],
+			bool depth_accept, bool inside, const PS& shader)
+	{
+		bool written = false;
+		int64_t e0 = row[0];
+		int64_t e1 = row[1];
+		int64_t e2 = row[2];
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			if (inside || (e0 | e1 | e2) >= 0)
+			{
+				float w0 = static_cast<float>(e0 - triangle.edge_bias[0]) * triangle.inv_area;
+				float w1 = static_cast<float>(e1 - triangle.edge_bias[1]) * triangle.inv_area;
+				float w2 = static_cast<float>(e2 - triangle.edge_bias[2]) * triangle.inv_area;
+				float depth = w0 * triangle.z[0] + w1 * triangle.z[1] + w2 * triangle.z[2];
+
+				if (depth_accept || depth_test(depth, x, y))
+				{
+					if (depth_buffer)
+					{
+						depth_buffer->item(x, y) = depth;
+					}
+					shade_pixel(triangle, x, y, w0, w1, w2, depth, shader);
+					written = true;
+				}
+			}
+			e0 += triangle.edge_step_x[0];
+			e1 += triangle.edge_step_x[1];
+			e2 += triangle.edge_step_x[2];
+		}
+		return written;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline bool rasterizer<VB, RT, Layout>::rasterize_span_msaa(
+			const raster_triangle<VB>& triangle, int y, int min_x, int max_x, const int64_t (&row)[3],
+			const PS& shader)
+	{
+		// Edge steps are whole pixels of subpixel steps, so sample offsets stay exact
+		int64_t sample_offset[MSAA_SAMPLES][3];
+		for (int s = 0; s < MSAA_SAMPLES; ++s)
+		{
+			for (int e = 0; e < 3; ++e)
+			{
+				sample_offset[s][e] = (SAMPLE_OFFSET_X[s] * triangle.edge_step_x[e] +
+									   SAMPLE_OFFSET_Y[s] * triangle.edge_step_y[e]) / SUBPIXEL_ONE;
+			}
+		}
+
+		bool written = false;
+		int64_t edge[3] = {row[0], row[1], row[2]};
+		for (int x = min_x; x <= max_x; ++x)
+		{
+			float w[MSAA_SAMPLES][3];
+			float depth[MSAA_SAMPLES];
+			unsigned int coverage = 0;
+			for (int s = 0; s < MSAA_SAMPLES; ++s)
+			{
+				const int64_t e0 = edge[0] + sample_offset[s][0];
+				const int64_t e1 = edge[1] + sample_offset[s][1];
+				const int64_t e2 = edge[2] + sample_offset[s][2];
+				if ((e0 | e1 | e2) >= 0)
+				{
+					w[s][0] = static_cast<float>(e0 - triangle.edge_bias[0]) * triangle.inv_area;
+					w[s][1] = static_cast<float>(e1 - triangle.edge_bias[1]) * triangle.inv_area;
+					w[s][2] = static_cast<float>(e2 - triangle.edge_bias[2]) * triangle.inv_area;
+					depth[s] = w[s][0] * triangle.z[0] + w[s][1] * triangle.z[1] + w[s][2] * triangle.z[2];
+					coverage |= 1u << s;
+				}
+			}
+
+			const unsigned int geometric_coverage = coverage;
+			const size_t first_sample = (static_cast<size_t>(y) * width + x) * MSAA_SAMPLES;
+			if (coverage && depth_buffer)
+			{
+				float farthest = -std::numeric_limits<float>::infinity();
+				for (int s = 0; s < MSAA_SAMPLES; ++s)
+				{
+					float& stored = sample_depths[first_sample + s];
+					if ((coverage & (1u << s)) && depth_passes(depth[s], stored))
+					{
+						stored = depth[s];
+					}
+					else
+					{
+						coverage &= ~(1u << s);
+					}
+					farthest = std::max(farthest, stored);
+				}
+				depth_buffer->item(x, y) = farthest;
+			}
+
+			if (coverage)
+			{
+				written = true;
+				if constexpr (!std::is_same_v<PS, depth_only> && !std::is_same_v<PS, visibility_writer>)
+				{
+					// Shade at the center when it is inside, otherwise at the first covered
+					// sample so attributes are never extrapolated. Depth results do not move
+					// the shading point, which keeps a depth prepass exact.
+					float center_w[3];
+					float shade_depth;
+					const float* shade_w = center_w;
+					if ((edge[0] | edge[1] | edge[2]) >= 0)
+					{
+						for (int e = 0; e < 3; ++e)
+						{
+							center_w[e] = static_cast<float>(edge[e] - triangle.edge_bias[e]) * triangle.inv_area;
+						}
+						shade_depth = center_w[0] * triangle.z[0] + center_w[1] * triangle.z[1] + center_w[2] * triangle.z[2];
+					}
+					else
+					{
+						int s = 0;
+						while (!(geometric_coverage & (1u << s)))
+						{
+							++s;
+						}
+						shade_w = w[s];
+						shade_depth = depth[s];
+					}
+
+					const RT color = RT::from_color(run_pixel_shader(triangle, shade_w[0], shade_w[1], shade_w[2], shade_depth, shader));
+					for (int s = 0; s < MSAA_SAMPLES; ++s)
+					{
+						if (coverage & (1u << s))
+						{
+							sample_colors[first_sample + s] = color;
+						}
+					}
+				}
+			}
+
+			edge[0] += triangle.edge_step_x[0];
+			edge[1] += triangle.edge_step_x[1];
+			edge[2] += triangle.edge_step_x[2];
+		}
+		return written;
+	}
+
+#ifdef __AVX2__
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline bool rasterizer<VB, RT, Layout>::rasterize_span_simd(
+			const raster_triangle<VB>& triangle, int y, int min_x, int max_x, const int64_t (&row)[3],
+			bool depth_accept, bool inside, const PS& shader)
+	{
+		bool written = false;
+		// Edge values farther than this from zero keep their sign across all 8 lanes
+		// (simd_steps bounds 7 * edge_step_x well below it), closer ones fit in int32 lanes
+		constexpr int64_t edge_limit = int64_t{1} << 30;
+
+		const __m256i lane_index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+		const __m256 inv_area = _mm256_set1_ps(triangle.inv_area);
+		__m256i lane_step[3];
+		for (int e = 0; e < 3; ++e)
+		{
+			lane_step[e] = _mm256_mullo_epi32(lane_index, _mm256_set1_epi32(static_cast<int>(triangle.edge_step_x[e])));
+		}
+
+		int64_t edge[3] = {row[0], row[1], row[2]};
+		for (int x = min_x; x <= max_x; x += 8)
+		{
+			__m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(max_x - x + 1), lane_index);
+			__m256 w[3];
+			bool empty = false;
+			for (int e = 0; e < 3 && !empty; ++e)
+			{
+				if (edge[e] < -edge_limit)
+				{
+					empty = true;
+				}
+				else if (edge[e] >= edge_limit)
+				{
+					// Rare far edges of huge triangles: each lane is converted from its exact
+					// 64-bit value, so the barycentrics match the scalar span bit for bit
+					alignas(32) float lane_edge[8];
+					for (int lane = 0; lane < 8; ++lane)
+					{
+						lane_edge[lane] = static_cast<float>(edge[e] + lane * triangle.edge_step_x[e] - triangle.edge_bias[e]);
+					}
+					w[e] = _mm256_mul_ps(_mm256_load_ps(lane_edge), inv_area);
+				}
+				else
+				{
+					__m256i lanes = _mm256_add_epi32(_mm256_set1_epi32(static_cast<int>(edge[e])), lane_step[e]);
+					if (!inside)
+					{
+						mask = _mm256_and_si256(mask, _mm256_cmpgt_epi32(lanes, _mm256_set1_epi32(-1)));
+					}
+					lanes = _mm256_sub_epi32(lanes, _mm256_set1_epi32(triangle.edge_bias[e]));
+					w[e] = _mm256_mul_ps(_mm256_cvtepi32_ps(lanes), inv_area);
+				}
+			}
+			for (int e = 0; e < 3; ++e)
+			{
+				edge[e] += 8 * triangle.edge_step_x[e];
+			}
+			if (empty || _mm256_testz_si256(mask, mask))
+			{
+				continue;
+			}
+
+			__m256 depth = _mm256_mul_ps(w[0], _mm256_set1_ps(triangle.z[0]));
+			depth = _mm256_add_ps(depth, _mm256_mul_ps(w[1], _mm256_set1_ps(triangle.z[1])));
+			depth = _mm256_add_ps(depth, _mm256_mul_ps(w[2], _mm256_set1_ps(triangle.z[2])));
+
+			if (depth_buffer)
+			{
+				float* depth_row = &depth_buffer->item(x, y);
+				if (!depth_accept)
+				{
+					__m256 stored = _mm256_maskload_ps(depth_row, mask);
+					__m256 passed;
+					switch (depth_function)
+					{
+						case depth_func::less:
+							passed = _mm256_cmp_ps(depth, stored, _CMP_LT_OQ);
+							break;
+						case depth_func::less_equal:
+							passed = _mm256_cmp_ps(depth, stored, _CMP_LE_OQ);
+							break;
+						default:
+							passed = _mm256_cmp_ps(depth, stored, _CMP_EQ_OQ);
+							break;
+					}
+					mask = _mm256_and_si256(mask, _mm256_castps_si256(passed));
+				}
+				_mm256_maskstore_ps(depth_row, mask, depth);
+			}
+
+			// Only lanes that survived the depth test are interpolated and shaded
+			int bits = _mm256_movemask_ps(_mm256_castsi256_ps(mask));
+			if (bits == 0)
+			{
+				continue;
+			}
+			written = true;
+			if constexpr (std::is_same_v<PS, depth_only>)
+			{
+				continue;
+			}
+			alignas(32) float lane_w0[8], lane_w1[8], lane_w2[8], lane_depth[8];
+			_mm256_store_ps(lane_w0, w[0]);
+			_mm256_store_ps(lane_w1, w[1]);
+			_mm256_store_ps(lane_w2, w[2]);
+			_mm256_store_ps(lane_depth, depth);
+			for (int lane = 0; lane < 8; ++lane)
+			{
+				if (bits & (1 << lane))
+				{
+					shade_pixel(triangle, x + lane, y, lane_w0[lane], lane_w1[lane], lane_w2[lane], lane_depth[lane], shader);
+				}
+			}
+		}
+		return written;
+	}
+#endif
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline void rasterizer<VB, RT, Layout>::shade_pixel(
+			const raster_triangle<VB>& triangle, int x, int y, float w0, float w1, float w2, float depth,
+			const PS& shader)
+	{
+		if constexpr (std::is_same_v<PS, visibility_writer>)
+		{
+			visibility_buffer->item(x, y) = triangle.id;
+		}
+		else if constexpr (!std::is_same_v<PS, depth_only>)
+		{
+			render_target->item(x, y) = RT::from_color(run_pixel_shader(triangle, w0, w1, w2, depth, shader));
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename PS>
+	inline cg::color rasterizer<VB, RT, Layout>::run_pixel_shader(
+			const raster_triangle<VB>& triangle, float w0, float w1, float w2, float depth, const PS& shader) const
+	{
+		// Screen-space barycentrics are weighted by 1 / w, so attributes do not swim under perspective
+		const float p0 = w0 * triangle.inv_w[0];
+		const float p1 = w1 * triangle.inv_w[1];
+		const float p2 = w2 * triangle.inv_w[2];
+		const float inv_sum = 1.f / (p0 + p1 + p2);
+		const float b0 = p0 * inv_sum;
+		const float b1 = p1 * inv_sum;
+		const float b2 = p2 * inv_sum;
+		const VB pixel_data = interpolate(triangle.data, b0, b1, b2);
+		if constexpr (std::is_invocable_v<const PS&, const VB&, float, const VB&, const VB&>)
+		{
+			// Exact derivative of the perspective divide at this pixel: one pixel step moves
+			// w_i by edge_step * inv_area, and d(sum p_i a_i / sum p_i) = sum dp_i (a_i - a) / sum p_i
+			const auto derivative = [&](const int64_t (&edge_step)[3]) {
+				const float d0 = edge_step[0] * triangle.inv_area * triangle.inv_w[0];
+				const float d1 = edge_step[1] * triangle.inv_area * triangle.inv_w[1];
+				const float d2 = edge_step[2] * triangle.inv_area * triangle.inv_w[2];
+				const float d_sum = d0 + d1 + d2;
+				return interpolate(
+						triangle.data, (d0 - b0 * d_sum) * inv_sum, (d1 - b1 * d_sum) * inv_sum,
+						(d2 - b2 * d_sum) * inv_sum);
+			};
+			return shader(pixel_data, depth, derivative(triangle.edge_step_x), derivative(triangle.edge_step_y));
+		}
+		else
+		{
+			return shader(pixel_data, depth);
+		}
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline VB rasterizer<VB, RT, Layout>::interpolate(const VB (&data)[3], float w0, float w1, float w2)
+	{
+		VB result = data[0];
+		result.position = w0 * data[0].position + w1 * data[1].position + w2 * data[2].position;
+		result.normal = w0 * data[0].normal + w1 * data[1].normal + w2 * data[2].normal;
+		result.color = w0 * data[0].color + w1 * data[1].color + w2 * data[2].color;
+		result.texcoord = w0 * data[0].texcoord + w1 * data[1].texcoord + w2 * data[2].texcoord;
+		return result;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline VB rasterizer<VB, RT, Layout>::lerp(const VB& a, const VB& b, float t)
+	{
+		VB result = a;
+		result.position = a.position + t * (b.position - a.position);
+		result.normal = a.normal + t * (b.normal - a.normal);
+		result.color = a.color + t * (b.color - a.color);
+		result.texcoord = a.texcoord + t * (b.texcoord - a.texcoord);
+		return result;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline int64_t
+	rasterizer<VB, RT, Layout>::edge_function(int2 a, int2 b, int2 c)
+	{
+		// TODO Lab: 1.05 Implement `cg::renderer::rasterizer::edge_function` method
+		return static_cast<int64_t>(c.x - a.x) * (b.y - a.y) - static_cast<int64_t>(c.y - a.y) * (b.x - a.x);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline bool rasterizer<VB, RT, Layout>::depth_test(float z, size_t x, size_t y)
+	{
+		if (!depth_buffer)
+		{
+			return true;
+		}
+		return depth_passes(z, depth_buffer->item(x, y));
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline bool rasterizer<VB, RT, Layout>::depth_passes(float z, float stored) const
+	{
+		switch (depth_function)
+		{
+			case depth_func::less:
+				return z < stored;
+			case depth_func::less_equal:
+				return z <= stored;
+			default:
+				return z == stored;
 		}
-		return depth_buffer->item(x, y) > z;
 	}
 
 }// namespace cg::renderer
\ No newline at end of file
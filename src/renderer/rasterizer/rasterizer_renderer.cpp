@@ -1,23 +1,175 @@
 #include "rasterizer_renderer.h"
 #include "utils/resource_utils.h"
 
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <map>
+
+
 void cg::renderer::rasterization_renderer::init()
 {
-    render_target = std::make_shared<cg::resource<cg::unsigned_color>>(width, height);
-    depth_buffer = std::make_shared<cg::resource<float>>(width, height);
+    rasterizer = std::make_shared<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>>();
+    rasterizer->set_viewport(settings->width, settings->height);
+    rasterizer->set_tile_binning(settings->raster_tile_binning);
+    rasterizer->set_pipelining(settings->raster_pipelining);
+    rasterizer->set_cull_mode(settings->raster_backface_culling ? cull_mode::back : cull_mode::none);
+    rasterizer->set_msaa(settings->raster_msaa);
+
+    render_target = std::make_shared<cg::resource<cg::unsigned_color>>(settings->width, settings->height);
+    depth_buffer = std::make_shared<cg::resource<float>>(settings->width, settings->height);
     rasterizer->set_render_target(render_target, depth_buffer);
-    rasterizer->set_viewport(width, height);
+    if (settings->raster_visibility_buffer)
+    {
+        visibility_buffer = std::make_shared<cg::resource<unsigned int>>(settings->width, settings->height);
+        rasterizer->set_visibility_buffer(visibility_buffer);
+    }
+
+    model = std::make_shared<cg::world::model>();
+    model->load_obj(settings->model_path);
+
+    // Shapes sharing a material share one texture and its mip chain
+    std::map<std::filesystem::path, std::shared_ptr<cg::renderer::texture>> loaded_textures;
+    for (const auto& texture_file : model->get_per_shape_texture_files())
+    {
+        if (texture_file.empty())
+        {
+            textures.push_back(nullptr);
+            continue;
+        }
+        auto& texture = loaded_textures[texture_file];
+        if (!texture)
+        {
+            texture = cg::utils::load_texture(texture_file, settings->raster_texture_compression);
+        }
+        textures.push_back(texture);
+    }
+    texture_sampler.filter = settings->raster_trilinear_filtering ? texture_filter::trilinear : texture_filter::bilinear;
+
+    camera = std::make_shared<cg::world::camera>();
+    camera->set_height(static_cast<float>(settings->height));
+    camera->set_width(static_cast<float>(settings->width));
+    camera->set_position(float3{
+            settings->camera_position[0],
+            settings->camera_position[1],
+            settings->camera_position[2]});
+    camera->set_theta(settings->camera_theta);
+    camera->set_phi(settings->camera_phi);
+    camera->set_angle_of_view(settings->camera_angle_of_view);
+    camera->set_z_near(settings->camera_z_near);
+    camera->set_z_far(settings->camera_z_far);
+
+    if (settings->raster_occlusion_culling)
+    {
+        occlusion_culler = std::make_shared<cg::renderer::occlusion_culler<cg::vertex>>();
+        occlusion_culler->set_viewport(settings->width / OCCLUSION_DOWNSCALE, settings->height / OCCLUSION_DOWNSCALE);
+
+        const auto& bounds = model->get_shape_bounds();
+        const auto surface_area = [&](size_t shape_id) {
+            const float3 extent = bounds[shape_id].max - bounds[shape_id].min;
+            return extent.x * extent.y + extent.y * extent.z + extent.z * extent.x;
+        };
+        for (size_t shape_id = 0; shape_id < bounds.size(); ++shape_id)
+        {
+            occluders.push_back(shape_id);
+        }
+        std::sort(occluders.begin(), occluders.end(), [&](size_t a, size_t b) {
+            return surface_area(a) > surface_area(b);
+        });
+        occluders.resize(std::min(occluders.size(), OCCLUDER_COUNT));
+    }
 }
 
 void cg::renderer::rasterization_renderer::render()
 {
+    float4x4 matrix = mul(
+            camera->get_projection_matrix(),
+            camera->get_view_matrix(),
+            model->get_world_matrix());
+
+    rasterizer->set_transform(matrix);
+    auto pixel_shader = [&](const cg::vertex& vertex_data, const float, const cg::vertex& ddx, const cg::vertex& ddy) {
+        if (vertex_data.texture_id < 0)
+        {
+            return cg::color::from_float3(vertex_data.color);
+        }
+        const float4 texel = texture_sampler.sample(
+                *textures[vertex_data.texture_id], vertex_data.texcoord, ddx.texcoord, ddy.texcoord);
+        return cg::color::from_float3(vertex_data.color * float3{texel.x, texel.y, texel.z});
+    };
+
+    auto start = std::chrono::high_resolution_clock::now();
     rasterizer->clear_render_target(cg::unsigned_color{0, 0, 0}, DEFAULT_DEPTH);
+    auto stop = std::chrono::high_resolution_clock::now();
+    std::chrono::duration<float, std::milli> duration = stop - start;
+    if (settings->raster_statistics)
+    {
+        std::cout << "Clearing took " << duration.count() << "ms\n";
+    }
+
+    start = std::chrono::high_resolution_clock::now();
+    if (occlusion_culler)
+    {
+        occlusion_culler->set_transform(matrix);
+        occlusion_culler->clear();
+        for (const size_t shape_id : occluders)
+        {
+            occlusion_culler->add_occluder(model->get_vertex_buffers()[shape_id], model->get_index_buffers()[shape_id]);
+        }
+    }
+
+    std::vector<cg::renderer::draw_range<cg::vertex>> shapes;
+    for (size_t shape_id = 0; shape_id < model->get_vertex_buffers().size(); ++shape_id)
+    {
+        const auto& bounds = model->get_shape_bounds()[shape_id];
+        if (occlusion_culler && !occlusion_culler->is_visible(bounds.min, bounds.max))
+        {
+            continue;
+        }
+        shapes.push_back({
+                model->get_vertex_buffers()[shape_id],
+                model->get_index_buffers()[shape_id],
+                model->get_index_buffers()[shape_id]->count(),
+                0});
+    }
+    if (settings->raster_depth_prepass)
+    {
+        // Shading then runs once per pixel: only the nearest fragment matches the prepass depth
+        rasterizer->multi_draw(shapes, nullptr, cg::renderer::depth_only{});
+        rasterizer->set_depth_func(cg::renderer::depth_func::equal);
+        rasterizer->multi_draw(shapes, nullptr, pixel_shader);
+        rasterizer->set_depth_func(cg::renderer::depth_func::less);
+    }
+    else
+    {
+        rasterizer->multi_draw(shapes, nullptr, pixel_shader);
+    }
+    if (occlusion_culler && settings->raster_statistics)
+    {
+        std::cout << "Occlusion culling skipped " << model->get_vertex_buffers().size() - shapes.size()
+                  << " of " << model->get_vertex_buffers().size() << " shapes\n";
+    }
+    if (visibility_buffer)
+    {
+        rasterizer->resolve_visibility(pixel_shader);
+    }
+    stop = std::chrono::high_resolution_clock::now();
+    duration = stop - start;
+    if (settings->raster_statistics)
+    {
+        std::cout << "Rendering took " << duration.count() << "ms\n";
+    }
+
+    rasterizer->resolve();
+    cg::utils::save_resource(*render_target, settings->result_path);
 }
 
 void cg::renderer::rasterization_renderer::destroy()
 {
     render_target.reset();
     depth_buffer.reset();
+    visibility_buffer.reset();
+    textures.clear();
 }
 
 void cg::renderer::rasterization_renderer::update()
@@ -1,5 +1,7 @@
+#include "renderer/rasterizer/occlusion_culler.h"
 #include "renderer/rasterizer/rasterizer.h"
 #include "renderer/renderer.h"
+#include "renderer/texture.h"
 #include "resource.h"
 
 
@@ -17,7 +19,18 @@ namespace cg::renderer
 	protected:
 		std::shared_ptr<cg::resource<cg::unsigned_color>> render_target;
 		std::shared_ptr<cg::resource<float>> depth_buffer;
+		std::shared_ptr<cg::resource<unsigned int>> visibility_buffer;
 
 		std::shared_ptr<cg::renderer::rasterizer<cg::vertex, cg::unsigned_color>> rasterizer;
+
+		// Shapes with the largest bounds are drawn as occluders into a depth buffer 8x smaller per axis
+		static constexpr size_t OCCLUDER_COUNT = 8;
+		static constexpr size_t OCCLUSION_DOWNSCALE = 8;
+		std::shared_ptr<cg::renderer::occlusion_culler<cg::vertex>> occlusion_culler;
+		std::vector<size_t> occluders;
+
+		// Indexed by cg::vertex::texture_id, null for untextured shapes
+		std::vector<std::shared_ptr<cg::renderer::texture>> textures;
+		cg::renderer::sampler texture_sampler;
 	};
 }// namespace cg::renderer
\ No newline at end of file
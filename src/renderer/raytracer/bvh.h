@@ -0,0 +1,772 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <linalg.h>
+#include <numeric>
+#include <omp.h>
+#include <vector>
+
+using namespace linalg::aliases;
+
+// Tasks and atomic capture need OpenMP 3.1; older runtimes (MSVC's default 2.0) build serially
+#if defined(_OPENMP) && _OPENMP >= 201107
+#define CG_OPENMP_TASKS 1
+#else
+#define CG_OPENMP_TASKS 0
+#endif
+
+namespace cg::renderer
+{
+	// Inner nodes keep both children next to each other at `first` and `first + 1`.
+	// Leaves own `count` primitives from position `first` of the primitive order.
+	struct bvh_node
+	{
+		float3 aabb_min;
+		float3 aabb_max;
+		unsigned int first;
+		unsigned int count;
+	};
+
+	struct bvh_statistics
+	{
+		size_t primitives = 0;
+		size_t nodes = 0;
+		size_t leaves = 0;
+		size_t max_depth = 0;
+		float average_leaf_size = 0.f;
+		// Expected traversal plus intersection cost of a random ray hitting the root box
+		float sah_cost = 0.f;
+		// The cost right after the last build, refits of moving primitives usually raise it
+		float build_sah_cost = 0.f;
+	};
+
+	enum class bvh_builder
+	{
+		// Binned surface area heuristic, the better tree for static scenes
+		sah,
+		// Linear BVH over sorted Morton codes of the centroids, much faster to build
+		lbvh
+	};
+
+	// Bounding volume hierarchy over primitive bounds. The SAH builder splits by the
+	// surface area heuristic evaluated at BIN_COUNT centroid bins per axis.
+	class bvh
+	{
+	public:
+		void build(
+				const std::vector<float3>& primitive_min, const std::vector<float3>& primitive_max,
+				bvh_builder builder = bvh_builder::sah);
+		// Recomputes the node boxes for new bounds of the same primitives, keeping the tree.
+		// Bounds are indexed by input primitive id like in build.
+		void refit(const std::vector<float3>& primitive_min, const std::vector<float3>& primitive_max);
+
+		const std::vector<bvh_node>& get_nodes() const;
+		// Input primitive ids in leaf order
+		const std::vector<unsigned int>& get_primitive_order() const;
+		const bvh_statistics& get_statistics() const;
+
+		// Visits the leaves hit within [min_t, max_t], nearer children first. `leaf(first, count)`
+		// tests the leaf's primitives, lowers max_t on closer hits and returns true to stop.
+		// Subtrees entered beyond the lowered max_t are skipped.
+		template<typename LEAF>
+		void traverse(const float3& origin, const float3& direction, float min_t, float& max_t, const LEAF& leaf) const;
+
+		static constexpr int BIN_COUNT = 16;
+		static constexpr unsigned int MAX_LEAF_SIZE = 8;
+		static constexpr int MAX_DEPTH = 64;
+		static constexpr float TRAVERSAL_COST = 1.f;
+		static constexpr float INTERSECTION_COST = 1.f;
+		// Nodes with more primitives build their children as OpenMP tasks
+		static constexpr unsigned int PARALLEL_SUBTREE_SIZE = 1024;
+		// Nodes with at least two chunks of primitives bin them chunk by chunk in parallel
+		static constexpr unsigned int PARALLEL_CHUNK_SIZE = 16384;
+		// Refits nodes of the upper levels as OpenMP tasks
+		static constexpr int PARALLEL_REFIT_DEPTH = 10;
+		// Centroid quantization per axis of the LBVH, sorted in one radix pass per axis
+		static constexpr int MORTON_BITS = 10;
+
+	protected:
+		struct node_bounds
+		{
+			float3 box_min{std::numeric_limits<float>::max()};
+			float3 box_max{std::numeric_limits<float>::lowest()};
+			float3 centroid_min{std::numeric_limits<float>::max()};
+			float3 centroid_max{std::numeric_limits<float>::lowest()};
+		};
+
+		// Primitive bounds and counts per centroid bin, for each axis
+		struct bin_set
+		{
+			bin_set()
+			{
+				for (int axis = 0; axis < 3; ++axis)
+				{
+					std::fill(std::begin(bin_min[axis]), std::end(bin_min[axis]), float3{std::numeric_limits<float>::max()});
+					std::fill(std::begin(bin_max[axis]), std::end(bin_max[axis]), float3{std::numeric_limits<float>::lowest()});
+					std::fill(std::begin(bin_count[axis]), std::end(bin_count[axis]), 0u);
+				}
+			}
+			float3 bin_min[3][BIN_COUNT];
+			float3 bin_max[3][BIN_COUNT];
+			unsigned int bin_count[3][BIN_COUNT];
+		};
+
+		std::vector<bvh_node> nodes;
+		// Nodes handed out so far during a build
+		unsigned int node_count = 0;
+		std::vector<unsigned int> primitive_order;
+		bvh_statistics statistics;
+
+		std::vector<float3> bounds_min;
+		std::vector<float3> bounds_max;
+		std::vector<float3> centroids;
+
+		// Runs inside build's parallel region, large children become tasks
+		void build_node(unsigned int node_index, unsigned int first, unsigned int count, int depth);
+		void build_lbvh();
+		node_bounds compute_bounds(unsigned int first, unsigned int count) const;
+		// `range(first, count)` over chunks of primitive_order, folded with `merge(result, other)`
+		template<typename T, typename RANGE, typename MERGE>
+		T reduce_range(unsigned int first, unsigned int count, const RANGE& range, const MERGE& merge) const;
+		void refit_node(unsigned int node_index, const float3* primitive_min, const float3* primitive_max, int depth);
+		void update_statistics();
+		void gather_statistics(unsigned int node_index, size_t depth);
+
+		static float surface_area(const float3& box_min, const float3& box_max);
+		// Stable parallel LSD radix sort by the Morton code in the upper half of the keys
+		static void sort_keys(std::vector<uint64_t>& keys);
+		// Moves bit i of a 10-bit value to bit 3i
+		static uint32_t spread_bits(uint32_t value);
+		static int count_leading_zeros(uint64_t value);
+		static bool intersect_box(
+				const bvh_node& node, const float3& origin, const float3& inv_direction, float min_t, float max_t,
+				float& entry_t);
+	};
+
+	inline void bvh::build(
+			const std::vector<float3>& primitive_min, const std::vector<float3>& primitive_max, bvh_builder builder)
+	{
+		const unsigned int primitive_count = static_cast<unsigned int>(primitive_min.size());
+		bounds_min = primitive_min;
+		bounds_max = primitive_max;
+		centroids.resize(primitive_count);
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(primitive_count); ++i)
+		{
+			centroids[i] = 0.5f * (bounds_min[i] + bounds_max[i]);
+		}
+		primitive_order.resize(primitive_count);
+		std::iota(primitive_order.begin(), primitive_order.end(), 0u);
+
+		nodes.clear();
+		statistics = bvh_statistics{};
+		statistics.primitives = primitive_count;
+		if (primitive_count == 0)
+		{
+			return;
+		}
+		// A binary tree with one primitive or more per leaf never needs more
+		nodes.resize(2 * size_t{primitive_count} - 1);
+		if (builder == bvh_builder::lbvh)
+		{
+			build_lbvh();
+		}
+		else
+		{
+			node_count = 1;
+			#pragma omp parallel
+			{
+				#pragma omp single
+				build_node(0, 0, primitive_count, 0);
+			}
+			// Children come from one counter, so the used nodes are already contiguous
+			nodes.resize(node_count);
+		}
+
+		update_statistics();
+		statistics.build_sah_cost = statistics.sah_cost;
+
+		bounds_min.clear();
+		bounds_max.clear();
+		centroids.clear();
+	}
+
+	inline void bvh::refit(const std::vector<float3>& primitive_min, const std::vector<float3>& primitive_max)
+	{
+		if (nodes.empty())
+		{
+			return;
+		}
+		#pragma omp parallel
+		{
+			#pragma omp single
+			refit_node(0, primitive_min.data(), primitive_max.data(), 0);
+		}
+		update_statistics();
+	}
+
+	inline const std::vector<bvh_node>& bvh::get_nodes() const
+	{
+		return nodes;
+	}
+
+	inline const std::vector<unsigned int>& bvh::get_primitive_order() const
+	{
+		return primitive_order;
+	}
+
+	inline const bvh_statistics& bvh::get_statistics() const
+	{
+		return statistics;
+	}
+
+	inline void bvh::build_node(unsigned int node_index, unsigned int first, unsigned int count, int depth)
+	{
+		const node_bounds bounds = compute_bounds(first, count);
+		nodes[node_index] = bvh_node{bounds.box_min, bounds.box_max, first, count};
+		if (count == 1 || depth >= MAX_DEPTH - 1)
+		{
+			return;
+		}
+
+		const float3 centroid_extent = bounds.centroid_max - bounds.centroid_min;
+		float3 bin_scale;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			bin_scale[axis] = centroid_extent[axis] > 0.f ? BIN_COUNT / centroid_extent[axis] : 0.f;
+		}
+		auto bin_of = [&](unsigned int primitive, int axis) {
+			return std::min(
+					static_cast<int>((centroids[primitive][axis] - bounds.centroid_min[axis]) * bin_scale[axis]),
+					BIN_COUNT - 1);
+		};
+		const bin_set bins = reduce_range<bin_set>(
+				first, count, [&](unsigned int range_first, unsigned int range_count) {
+					bin_set range_bins;
+					for (unsigned int i = range_first; i < range_first + range_count; ++i)
+					{
+						const unsigned int primitive = primitive_order[i];
+						for (int axis = 0; axis < 3; ++axis)
+						{
+							const int bin = bin_of(primitive, axis);
+							range_bins.bin_min[axis][bin] = min(range_bins.bin_min[axis][bin], bounds_min[primitive]);
+							range_bins.bin_max[axis][bin] = max(range_bins.bin_max[axis][bin], bounds_max[primitive]);
+							++range_bins.bin_count[axis][bin];
+						}
+					}
+					return range_bins;
+				},
+				[](bin_set& result, const bin_set& other) {
+					for (int axis = 0; axis < 3; ++axis)
+					{
+						for (int bin = 0; bin < BIN_COUNT; ++bin)
+						{
+							result.bin_min[axis][bin] = min(result.bin_min[axis][bin], other.bin_min[axis][bin]);
+							result.bin_max[axis][bin] = max(result.bin_max[axis][bin], other.bin_max[axis][bin]);
+							result.bin_count[axis][bin] += other.bin_count[axis][bin];
+						}
+					}
+				});
+
+		// Costs are relative to the node's area, the constant traversal cost is added below
+		float best_cost = std::numeric_limits<float>::max();
+		int best_axis = -1;
+		int best_split = 0;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			if (centroid_extent[axis] <= 0.f)
+			{
+				continue;
+			}
+
+			// Sweep from the right to get the cost of every right side, then from the left
+			float right_cost[BIN_COUNT];
+			float3 side_min{std::numeric_limits<float>::max()};
+			float3 side_max{std::numeric_limits<float>::lowest()};
+			unsigned int side_count = 0;
+			for (int bin = BIN_COUNT - 1; bin > 0; --bin)
+			{
+				side_min = min(side_min, bins.bin_min[axis][bin]);
+				side_max = max(side_max, bins.bin_max[axis][bin]);
+				side_count += bins.bin_count[axis][bin];
+				right_cost[bin] = side_count ? surface_area(side_min, side_max) * side_count : 0.f;
+			}
+			side_min = float3{std::numeric_limits<float>::max()};
+			side_max = float3{std::numeric_limits<float>::lowest()};
+			side_count = 0;
+			for (int split = 1; split < BIN_COUNT; ++split)
+			{
+				side_min = min(side_min, bins.bin_min[axis][split - 1]);
+				side_max = max(side_max, bins.bin_max[axis][split - 1]);
+				side_count += bins.bin_count[axis][split - 1];
+				if (side_count == 0 || side_count == count)
+				{
+					continue;
+				}
+				const float cost = surface_area(side_min, side_max) * side_count + right_cost[split];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = split;
+				}
+			}
+		}
+
+		// All centroids coincide: no split separates anything
+		if (best_axis < 0)
+		{
+			return;
+		}
+		const float split_cost = TRAVERSAL_COST + INTERSECTION_COST * best_cost / surface_area(bounds.box_min, bounds.box_max);
+		if (count <= MAX_LEAF_SIZE && split_cost >= INTERSECTION_COST * count)
+		{
+			return;
+		}
+
+		const auto middle = std::partition(
+				primitive_order.begin() + first, primitive_order.begin() + first + count,
+				[&](unsigned int primitive) { return bin_of(primitive, best_axis) < best_split; });
+		const unsigned int left_count = static_cast<unsigned int>(middle - (primitive_order.begin() + first));
+
+		unsigned int left;
+#if CG_OPENMP_TASKS
+		#pragma omp atomic capture
+		{
+			left = node_count;
+			node_count += 2;
+		}
+#else
+		left = node_count;
+		node_count += 2;
+#endif
+		nodes[node_index].first = left;
+		nodes[node_index].count = 0;
+#if CG_OPENMP_TASKS
+		// Subtrees own disjoint nodes and primitive ranges, large ones go to other threads
+		if (left_count >= PARALLEL_SUBTREE_SIZE)
+		{
+			#pragma omp task
+			build_node(left, first, left_count, depth + 1);
+		}
+		else
+		{
+			build_node(left, first, left_count, depth + 1);
+		}
+#else
+		build_node(left, first, left_count, depth + 1);
+#endif
+		build_node(left + 1, first + left_count, count - left_count, depth + 1);
+	}
+
+	inline void bvh::build_lbvh()
+	{
+		const int primitive_count = static_cast<int>(primitive_order.size());
+		node_bounds scene_bounds;
+		#pragma omp parallel
+		{
+			#pragma omp single
+			scene_bounds = compute_bounds(0, primitive_count);
+		}
+
+		// Morton code of the quantized centroid above the primitive id, which makes keys unique
+		const float3 centroid_extent = scene_bounds.centroid_max - scene_bounds.centroid_min;
+		float3 cell_scale;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			cell_scale[axis] = centroid_extent[axis] > 0.f ? (1 << MORTON_BITS) / centroid_extent[axis] : 0.f;
+		}
+		std::vector<uint64_t> keys(primitive_count);
+		#pragma omp parallel for
+		for (int i = 0; i < primitive_count; ++i)
+		{
+			const float3 cell = (centroids[i] - scene_bounds.centroid_min) * cell_scale;
+			uint64_t code = 0;
+			for (int axis = 0; axis < 3; ++axis)
+			{
+				const uint32_t coordinate = std::min(static_cast<uint32_t>(cell[axis]), (1u << MORTON_BITS) - 1);
+				code |= uint64_t{spread_bits(coordinate)} << (2 - axis);
+			}
+			keys[i] = (code << 32) | static_cast<uint32_t>(i);
+		}
+		sort_keys(keys);
+
+		if (primitive_count == 1)
+		{
+			nodes[0] = bvh_node{bounds_min[0], bounds_max[0], 0, 1};
+			return;
+		}
+
+		// Karras' radix tree: internal node i covers a key range with one end at i and splits it
+		// where the common prefix ends. Its children go to the node pair at 2i + 1, the root to 0.
+		std::vector<unsigned int> parents(primitive_count - 1);
+		std::vector<unsigned int> slots(primitive_count - 1);
+		std::vector<std::atomic<int>> arrivals(primitive_count - 1);
+		auto common_prefix = [&](int a, int b) {
+			return b < 0 || b >= primitive_count ? -1 : count_leading_zeros(keys[a] ^ keys[b]);
+		};
+		slots[0] = 0;
+		nodes[0].first = 1;
+		nodes[0].count = 0;
+		#pragma omp parallel for
+		for (int i = 0; i < primitive_count; ++i)
+		{
+			primitive_order[i] = static_cast<uint32_t>(keys[i]);
+		}
+		#pragma omp parallel for
+		for (int i = 0; i < primitive_count - 1; ++i)
+		{
+			arrivals[i].store(0, std::memory_order_relaxed);
+			// The range grows towards the neighbour sharing the longer prefix
+			const int direction = common_prefix(i, i + 1) > common_prefix(i, i - 1) ? 1 : -1;
+			const int outside_prefix = common_prefix(i, i - direction);
+			int length_bound = 2;
+			while (common_prefix(i, i + length_bound * direction) > outside_prefix)
+			{
+				length_bound *= 2;
+			}
+			int length = 0;
+			for (int step = length_bound / 2; step > 0; step /= 2)
+			{
+				if (common_prefix(i, i + (length + step) * direction) > outside_prefix)
+				{
+					length += step;
+				}
+			}
+			const int other_end = i + length * direction;
+
+			const int node_prefix = common_prefix(i, other_end);
+			int split = 0;
+			for (int divider = 2;; divider *= 2)
+			{
+				const int step = (length + divider - 1) / divider;
+				if (common_prefix(i, i + (split + step) * direction) > node_prefix)
+				{
+					split += step;
+				}
+				if (step == 1)
+				{
+					break;
+				}
+			}
+			const int left = i + split * direction + std::min(direction, 0);
+			const int children[2] = {left, left + 1};
+			const bool leaves[2] = {left == std::min(i, other_end), left + 1 == std::max(i, other_end)};
+			for (int child = 0; child < 2; ++child)
+			{
+				const unsigned int slot = 2 * i + 1 + child;
+				if (leaves[child])
+				{
+					const unsigned int primitive = primitive_order[children[child]];
+					nodes[slot] = bvh_node{bounds_min[primitive], bounds_max[primitive], static_cast<unsigned int>(children[child]), 1};
+				}
+				else
+				{
+					nodes[slot].first = 2 * children[child] + 1;
+					nodes[slot].count = 0;
+					slots[children[child]] = slot;
+					parents[children[child]] = i;
+				}
+			}
+		}
+
+		// Bounds bottom-up: each leaf climbs until it reaches a node whose other child is not done yet
+		#pragma omp parallel for
+		for (int i = 0; i < primitive_count - 1; ++i)
+		{
+			const int leaf_children = (nodes[2 * i + 1].count != 0) + (nodes[2 * i + 2].count != 0);
+			for (int leaf = 0; leaf < leaf_children; ++leaf)
+			{
+				int node = i;
+				while (arrivals[node].fetch_add(1, std::memory_order_acq_rel) == 1)
+				{
+					bvh_node& parent = nodes[slots[node]];
+					parent.aabb_min = min(nodes[2 * node + 1].aabb_min, nodes[2 * node + 2].aabb_min);
+					parent.aabb_max = max(nodes[2 * node + 1].aabb_max, nodes[2 * node + 2].aabb_max);
+					if (node == 0)
+					{
+						break;
+					}
+					node = parents[node];
+				}
+			}
+		}
+	}
+
+	inline bvh::node_bounds bvh::compute_bounds(unsigned int first, unsigned int count) const
+	{
+		return reduce_range<node_bounds>(
+				first, count, [&](unsigned int range_first, unsigned int range_count) {
+					node_bounds range_bounds;
+					for (unsigned int i = range_first; i < range_first + range_count; ++i)
+					{
+						const unsigned int primitive = primitive_order[i];
+						range_bounds.box_min = min(range_bounds.box_min, bounds_min[primitive]);
+						range_bounds.box_max = max(range_bounds.box_max, bounds_max[primitive]);
+						range_bounds.centroid_min = min(range_bounds.centroid_min, centroids[primitive]);
+						range_bounds.centroid_max = max(range_bounds.centroid_max, centroids[primitive]);
+					}
+					return range_bounds;
+				},
+				[](node_bounds& result, const node_bounds& other) {
+					result.box_min = min(result.box_min, other.box_min);
+					result.box_max = max(result.box_max, other.box_max);
+					result.centroid_min = min(result.centroid_min, other.centroid_min);
+					result.centroid_max = max(result.centroid_max, other.centroid_max);
+				});
+	}
+
+	template<typename T, typename RANGE, typename MERGE>
+	inline T bvh::reduce_range(unsigned int first, unsigned int count, const RANGE& range, const MERGE& merge) const
+	{
+#if !CG_OPENMP_TASKS
+		(void) merge;
+		return range(first, count);
+#else
+		if (count < 2 * PARALLEL_CHUNK_SIZE)
+		{
+			return range(first, count);
+		}
+		const unsigned int chunk_count = (count + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE;
+		std::vector<T> partial(chunk_count);
+		for (unsigned int chunk = 0; chunk < chunk_count; ++chunk)
+		{
+			#pragma omp task shared(partial)
+			partial[chunk] = range(
+					first + chunk * PARALLEL_CHUNK_SIZE, std::min(PARALLEL_CHUNK_SIZE, count - chunk * PARALLEL_CHUNK_SIZE));
+		}
+		#pragma omp taskwait
+		T result = partial[0];
+		for (unsigned int chunk = 1; chunk < chunk_count; ++chunk)
+		{
+			merge(result, partial[chunk]);
+		}
+		return result;
+#endif
+	}
+
+	inline void bvh::refit_node(
+			unsigned int node_index, const float3* primitive_min, const float3* primitive_max, int depth)
+	{
+		const unsigned int first = nodes[node_index].first;
+		const unsigned int count = nodes[node_index].count;
+		if (count)
+		{
+			float3 box_min{std::numeric_limits<float>::max()};
+			float3 box_max{std::numeric_limits<float>::lowest()};
+			for (unsigned int i = first; i < first + count; ++i)
+			{
+				box_min = min(box_min, primitive_min[primitive_order[i]]);
+				box_max = max(box_max, primitive_max[primitive_order[i]]);
+			}
+			nodes[node_index].aabb_min = box_min;
+			nodes[node_index].aabb_max = box_max;
+			return;
+		}
+#if CG_OPENMP_TASKS
+		if (depth < PARALLEL_REFIT_DEPTH)
+		{
+			#pragma omp task
+			refit_node(first, primitive_min, primitive_max, depth + 1);
+			refit_node(first + 1, primitive_min, primitive_max, depth + 1);
+			#pragma omp taskwait
+		}
+		else
+#endif
+		{
+			refit_node(first, primitive_min, primitive_max, depth + 1);
+			refit_node(first + 1, primitive_min, primitive_max, depth + 1);
+		}
+		nodes[node_index].aabb_min = min(nodes[first].aabb_min, nodes[first + 1].aabb_min);
+		nodes[node_index].aabb_max = max(nodes[first].aabb_max, nodes[first + 1].aabb_max);
+	}
+
+	inline void bvh::update_statistics()
+	{
+		statistics.leaves = 0;
+		statistics.max_depth = 0;
+		statistics.sah_cost = 0.f;
+		gather_statistics(0, 0);
+		statistics.nodes = nodes.size();
+		statistics.average_leaf_size = static_cast<float>(statistics.primitives) / static_cast<float>(statistics.leaves);
+	}
+
+	inline void bvh::gather_statistics(unsigned int node_index, size_t depth)
+	{
+		const bvh_node& node = nodes[node_index];
+		const float relative_area = surface_area(node.aabb_min, node.aabb_max) / surface_area(nodes[0].aabb_min, nodes[0].aabb_max);
+		statistics.max_depth = std::max(statistics.max_depth, depth);
+		if (node.count)
+		{
+			++statistics.leaves;
+			statistics.sah_cost += relative_area * INTERSECTION_COST * node.count;
+			return;
+		}
+		statistics.sah_cost += relative_area * TRAVERSAL_COST;
+		gather_statistics(node.first, depth + 1);
+		gather_statistics(node.first + 1, depth + 1);
+	}
+
+	inline float bvh::surface_area(const float3& box_min, const float3& box_max)
+	{
+		const float3 extent = max(box_max - box_min, float3{0.f});
+		// Flat boxes still need an area to compare, hence the tiny floor
+		return std::max(2.f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x),
+						std::numeric_limits<float>::min());
+	}
+
+	inline void bvh::sort_keys(std::vector<uint64_t>& keys)
+	{
+		constexpr unsigned int BUCKET_COUNT = 1u << MORTON_BITS;
+		std::vector<uint64_t> sorted(keys.size());
+		const int max_threads = omp_get_max_threads();
+		std::vector<unsigned int> offsets(size_t(max_threads) * BUCKET_COUNT);
+		for (int shift = 32; shift < 32 + 3 * MORTON_BITS; shift += MORTON_BITS)
+		{
+			#pragma omp parallel num_threads(max_threads)
+			{
+				const int threads = omp_get_num_threads();
+				const int thread = omp_get_thread_num();
+				const size_t begin = keys.size() * thread / threads;
+				const size_t end = keys.size() * (thread + 1) / threads;
+				unsigned int* thread_offsets = &offsets[size_t(thread) * BUCKET_COUNT];
+				std::fill(thread_offsets, thread_offsets + BUCKET_COUNT, 0u);
+				for (size_t i = begin; i < end; ++i)
+				{
+					++thread_offsets[(keys[i] >> shift) & (BUCKET_COUNT - 1)];
+				}
+				#pragma omp barrier
+				#pragma omp single
+				{
+					// Bucket after bucket, and thread after thread within one, keeps equal digits in order
+					unsigned int position = 0;
+					for (unsigned int bucket = 0; bucket < BUCKET_COUNT; ++bucket)
+					{
+						for (int other = 0; other < threads; ++other)
+						{
+							const unsigned int bucket_count = offsets[size_t(other) * BUCKET_COUNT + bucket];
+							offsets[size_t(other) * BUCKET_COUNT + bucket] = position;
+							position += bucket_count;
+						}
+					}
+				}
+				for (size_t i = begin; i < end; ++i)
+				{
+					sorted[thread_offsets[(keys[i] >> shift) & (BUCKET_COUNT - 1)]++] = keys[i];
+				}
+			}
+			keys.swap(sorted);
+		}
+	}
+
+	inline uint32_t bvh::spread_bits(uint32_t value)
+	{
+		value = (value * 0x00010001u) & 0xff0000ffu;
+		value = (value * 0x00000101u) & 0x0f00f00fu;
+		value = (value * 0x00000011u) & 0xc30c30c3u;
+		value = (value * 0x00000005u) & 0x49249249u;
+		return value;
+	}
+
+	inline int bvh::count_leading_zeros(uint64_t value)
+	{
+		if (value == 0)
+		{
+			return 64;
+		}
+		int count = 0;
+		for (int shift = 32; shift > 0; shift /= 2)
+		{
+			if ((value >> (64 - shift)) == 0)
+			{
+				count += shift;
+				value <<= shift;
+			}
+		}
+		return count;
+	}
+
+	inline bool bvh::intersect_box(
+			const bvh_node& node, const float3& origin, const float3& inv_direction, float min_t, float max_t,
+			float& entry_t)
+	{
+		const float3 t0 = (node.aabb_min - origin) * inv_direction;
+		const float3 t1 = (node.aabb_max - origin) * inv_direction;
+		entry_t = min_t;
+		float exit_t = max_t;
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			// 0 * inf for a ray running inside one of the slab's planes, which touches the box
+			if (std::isnan(t0[axis]) || std::isnan(t1[axis]))
+			{
+				continue;
+			}
+			entry_t = std::max(entry_t, std::min(t0[axis], t1[axis]));
+			exit_t = std::min(exit_t, std::max(t0[axis], t1[axis]));
+		}
+		return entry_t <= exit_t;
+	}
+
+	template<typename LEAF>
+	inline void bvh::traverse(
+			const float3& origin, const float3& direction, float min_t, float& max_t, const LEAF& leaf) const
+	{
+		const float3 inv_direction = 1.f / direction;
+		float entry_t;
+		if (nodes.empty() || !intersect_box(nodes[0], origin, inv_direction, min_t, max_t, entry_t))
+		{
+			return;
+		}
+
+		// Farther children postponed on the way down, with the distance they are entered at
+		unsigned int stack[MAX_DEPTH];
+		float stack_t[MAX_DEPTH];
+		int stack_size = 0;
+		unsigned int node_index = 0;
+		while (true)
+		{
+			const bvh_node& node = nodes[node_index];
+			if (node.count)
+			{
+				if (leaf(node.first, node.count))
+				{
+					return;
+				}
+			}
+			else
+			{
+				float left_t;
+				float right_t;
+				const bool left_hit = intersect_box(nodes[node.first], origin, inv_direction, min_t, max_t, left_t);
+				const bool right_hit = intersect_box(nodes[node.first + 1], origin, inv_direction, min_t, max_t, right_t);
+				if (left_hit && right_hit)
+				{
+					const bool left_first = left_t <= right_t;
+					stack[stack_size] = left_first ? node.first + 1 : node.first;
+					stack_t[stack_size++] = left_first ? right_t : left_t;
+					node_index = left_first ? node.first : node.first + 1;
+					continue;
+				}
+				if (left_hit || right_hit)
+				{
+					node_index = left_hit ? node.first : node.first + 1;
+					continue;
+				}
+			}
+
+			do
+			{
+				if (stack_size == 0)
+				{
+					return;
+				}
+				--stack_size;
+			} while (stack_t[stack_size] > max_t);
+			node_index = stack[stack_size];
+		}
+	}
+}// namespace cg::renderer
@@ -1,11 +1,17 @@
 #pragma once
 
+#include "bvh.h"
 #include "resource.h"
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <iostream>
 #include <linalg.h>
 #include <memory>
 #include <omp.h>
+#include <optional>
 #include <random>
+#include <type_traits>
 
 using namespace linalg::aliases;
 
@@ -61,61 +67,53 @@ namespace cg::renderer
 		nc = vertex_c.normal;
 
 		ambient = vertex_a.ambient;
-		diffuse = vertex_a.diffuse;
+		diffuse = vertex_a.color;
 		emissive = vertex_a.emissive;
 	}
 
+	// Bottom-level acceleration structure: one shape's triangles in object space
 	template<typename VB>
-	class aabb
+	struct blas
 	{
-	public:
-		void add_triangle(const triangle<VB>& triangle);
-		const std::vector<triangle<VB>>& get_triangles() const;
-		bool aabb_test(const ray& ray) const;
-
-	protected:
+		// In BVH leaf order
 		std::vector<triangle<VB>> triangles;
-		float3 aabb_min;
-		float3 aabb_max;
+		bvh triangle_bvh;
 	};
 
-	template<typename VB>
-	inline void aabb<VB>::add_triangle(const triangle<VB>& triangle)
+	// A shape placed in the world. The columns of the 3x4 transform are the shape's
+	// x, y and z axes and its origin in world space.
+	struct instance
 	{
-		triangles.push_back(triangle);
-		aabb_min = min(aabb_min, min(triangle.a, min(triangle.b, triangle.c)));
-		aabb_max = max(aabb_max, max(triangle.a, max(triangle.b, triangle.c)));
-	}
+		float3x4 transform;
+		size_t shape;
+	};
 
-	template<typename VB>
-	inline const std::vector<triangle<VB>>& aabb<VB>::get_triangles() const
+	// World to object space of an affine object to world transform
+	inline float3x4 inverse_transform(const float3x4& transform)
 	{
-		return triangles;
+		const float3 row_x = cross(transform[1], transform[2]);
+		const float3 row_y = cross(transform[2], transform[0]);
+		const float3 row_z = cross(transform[0], transform[1]);
+		const float inv_det = 1.f / dot(transform[0], row_x);
+		const float3x3 linear = transpose(float3x3{row_x * inv_det, row_y * inv_det, row_z * inv_det});
+		return float3x4{linear[0], linear[1], linear[2], -mul(linear, transform[3])};
 	}
 
+	// Moves a triangle to world space, normals by the inverse transpose
 	template<typename VB>
-	inline bool aabb<VB>::aabb_test(const ray& ray) const
+	inline triangle<VB> transform_triangle(const triangle<VB>& tri, const float3x4& to_world, const float3x4& to_object)
 	{
-		float tmin = (aabb_min.x - ray.position.x) / ray.direction.x;
-		float tmax = (aabb_max.x - ray.position.x) / ray.direction.x;
-		if (tmin > tmax) std::swap(tmin, tmax);
-
-		float tymin = (aabb_min.y - ray.position.y) / ray.direction.y;
-		float tymax = (aabb_max.y - ray.position.y) / ray.direction.y;
-		if (tymin > tymax) std::swap(tymin, tymax);
-
-		if ((tmin > tymax) || (tymin > tmax)) return false;
-
-		if (tymin > tmin) tmin = tymin;
-		if (tymax < tmax) tmax = tymax;
-
-		float tzmin = (aabb_min.z - ray.position.z) / ray.direction.z;
-		float tzmax = (aabb_max.z - ray.position.z) / ray.direction.z;
-		if (tzmin > tzmax) std::swap(tzmin, tzmax);
-
-		if ((tmin > tzmax) || (tzmin > tmax)) return false;
-
-		return true;
+		triangle<VB> result = tri;
+		result.a = mul(to_world, float4{tri.a, 1.f});
+		result.b = mul(to_world, float4{tri.b, 1.f});
+		result.c = mul(to_world, float4{tri.c, 1.f});
+		result.ba = result.b - result.a;
+		result.ca = result.c - result.a;
+		const float3x3 normal_matrix = transpose(float3x3{to_object[0], to_object[1], to_object[2]});
+		result.na = mul(normal_matrix, tri.na);
+		result.nb = mul(normal_matrix, tri.nb);
+		result.nc = mul(normal_matrix, tri.nc);
+		return result;
 	}
 
 	struct light
@@ -124,26 +122,73 @@ namespace cg::renderer
 		float3 color;
 	};
 
-	template<typename VB, typename RT>
+	// A shader stage counts as bound unless it is nullptr or an empty std::function
+	template<typename S>
+	inline bool shader_bound(const S& shader)
+	{
+		if constexpr (std::is_same_v<S, std::nullptr_t>)
+		{
+			return false;
+		}
+		else if constexpr (std::is_constructible_v<bool, const S&>)
+		{
+			return static_cast<bool>(shader);
+		}
+		else
+		{
+			return true;
+		}
+	}
+
+	// Layout is the storage order of the render target and the history buffer
+	template<typename VB, typename RT, typename Layout = linear_layout>
 	class raytracer
 	{
 	public:
 		raytracer(){};
 		~raytracer(){};
 
-		void set_render_target(std::shared_ptr<resource<RT>> in_render_target);
+		void set_render_target(std::shared_ptr<resource<RT, Layout>> in_render_target);
+		// Fast clear: the clear is only recorded. ray_generation overwrites every pixel,
+		// so the render target is only filled by resolve() if no frame was traced since.
 		void clear_render_target(const RT& in_clear_value);
+		void resolve();
 		void set_viewport(size_t in_width, size_t in_height);
 
 		void set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers);
 		void set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers);
+		// Shapes to trace and where, each shape once as it is when empty
+		void set_instances(std::vector<instance> in_instances);
+		void set_bvh_builder(bvh_builder in_builder);
+		// Builds a BVH per shape with the selected builder, then the top level over the
+		// instances, and reports their statistics
 		void build_acceleration_structure();
-		std::vector<aabb<VB>> acceleration_structures;
+		// Only rebuilds the top level, enough after moving instances
+		void build_top_level_acceleration_structure();
+		// Rereads the triangles after vertices moved and refits the shape BVHs to them. The index
+		// buffers must be those of the last build. Rebuilds a shape instead once its SAH cost
+		// exceeds max_sah_cost_growth times the cost of its last build, 0 keeps refitting.
+		void refit_acceleration_structure(float max_sah_cost_growth = 0.f);
+		const bvh& get_top_level_bvh() const;
+		const bvh& get_bottom_level_bvh(size_t shape) const;
 
 		void ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num);
 
 		payload trace_ray(const ray& ray, size_t depth, float max_t = 1000.f, float min_t = 0.001f) const;
+
+		// Compile-time shader binding: shaders are functors inlined into the traversal loop,
+		// pass nullptr for an unused stage. The std::function members below forward here.
+		template<typename MS, typename CHS, typename AHS>
+		void ray_generation(
+				float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num,
+				const MS& miss, const CHS& closest_hit, const AHS& any_hit);
+		template<typename MS, typename CHS, typename AHS>
+		payload trace_ray(
+				const ray& ray, size_t depth, const MS& miss, const CHS& closest_hit, const AHS& any_hit,
+				float max_t = 1000.f, float min_t = 0.001f) const;
 		payload intersection_shader(const triangle<VB>& triangle, const ray& ray) const;
+		// Triangle by its position in the index buffer of the shape
+		triangle<VB> fetch_triangle(size_t shape, size_t id) const;
 
 		std::function<payload(const ray& ray)> miss_shader = nullptr;
 		std::function<payload(const ray& ray, payload& payload, const triangle<VB>& triangle, size_t depth)>
@@ -153,119 +198,460 @@ namespace cg::renderer
 
 		float2 get_jitter(int frame_id);
 
+		// Side of the square pixel tiles ray_generation hands to threads
+		static constexpr int TILE_SIZE = 8;
+
 	protected:
-		std::shared_ptr<cg::resource<RT>> render_target;
-		std::shared_ptr<cg::resource<float3>> history;
+		std::shared_ptr<cg::resource<RT, Layout>> render_target;
+		std::shared_ptr<cg::resource<float3, Layout>> history;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::shared_ptr<cg::resource<VB>>> vertex_buffers;
-		std::vector<triangle<VB>> triangles;
+		std::vector<instance> instances;
+		bvh_builder builder = bvh_builder::sah;
+
+		// One per shape, shared by all its instances
+		std::vector<blas<VB>> bottom_levels;
+		bvh top_level;
+		struct traced_instance
+		{
+			float3x4 to_world;
+			float3x4 to_object;
+			size_t shape;
+			// Rays and hits need no transform
+			bool identity;
+		};
+		// In top level leaf order
+		std::vector<traced_instance> scene_instances;
+
+		void build_bottom_level(size_t shape);
 
 		size_t width = 1920;
 		size_t height = 1080;
+
+		RT clear_value{};
+		bool render_target_clear_pending = false;
+		bool history_clear_pending = false;
 	};
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_render_target(std::shared_ptr<resource<RT>> in_render_target)
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::set_render_target(std::shared_ptr<resource<RT, Layout>> in_render_target)
 	{
 		render_target = in_render_target;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_viewport(size_t in_width, size_t in_height)
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::set_viewport(size_t in_width, size_t in_height)
 	{
 		width = in_width;
 		height = in_height;
-		history = std::make_shared<resource<float3>>(width, height);
+		history = std::make_shared<resource<float3, Layout>>(width, height);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::clear_render_target(const RT& in_clear_value)
+	{
+		clear_value = in_clear_value;
+		render_target_clear_pending = true;
+		history_clear_pending = true;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::clear_render_target(const RT& in_clear_value)
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::resolve()
 	{
-		for (size_t i = 0; i < render_target->count(); ++i)
+		const auto fill_rows = [](auto& target, const auto& value) {
+			const int rows = static_cast<int>(target->count() / target->get_stride());
+			const size_t stride = target->get_stride();
+			#pragma omp parallel for
+			for (int y = 0; y < rows; ++y)
+			{
+				for (size_t x = 0; x < stride; x += Layout::row_run)
+				{
+					std::fill(&target->item(x, y), &target->item(x, y) + std::min(Layout::row_run, stride - x), value);
+				}
+			}
+		};
+		if (render_target_clear_pending && render_target)
 		{
-			render_target->item(i) = in_clear_value;
+			fill_rows(render_target, clear_value);
 		}
-		for (size_t i = 0; i < history->count(); ++i)
+		if (history_clear_pending && history)
 		{
-			history->item(i) = float3{0.f, 0.f, 0.f};
+			fill_rows(history, float3{0.f, 0.f, 0.f});
 		}
+		render_target_clear_pending = false;
+		history_clear_pending = false;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::set_vertex_buffers(std::vector<std::shared_ptr<cg::resource<VB>>> in_vertex_buffers)
 	{
 		vertex_buffers = in_vertex_buffers;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::set_index_buffers(std::vector<std::shared_ptr<cg::resource<unsigned int>>> in_index_buffers)
 	{
 		index_buffers = in_index_buffers;
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::build_acceleration_structure()
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::set_instances(std::vector<instance> in_instances)
+	{
+		instances = in_instances;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::set_bvh_builder(bvh_builder in_builder)
+	{
+		builder = in_builder;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::build_acceleration_structure()
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		bottom_levels.clear();
+		bottom_levels.resize(vertex_buffers.size());
+		for (size_t shape = 0; shape < vertex_buffers.size(); ++shape)
+		{
+			build_bottom_level(shape);
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+
+		size_t triangle_count = 0;
+		size_t node_count = 0;
+		size_t leaf_count = 0;
+		size_t max_depth = 0;
+		for (const auto& bottom_level: bottom_levels)
+		{
+			const bvh_statistics& statistics = bottom_level.triangle_bvh.get_statistics();
+			triangle_count += statistics.primitives;
+			node_count += statistics.nodes;
+			leaf_count += statistics.leaves;
+			max_depth = std::max(max_depth, statistics.max_depth);
+		}
+		std::cout << (builder == bvh_builder::lbvh ? "LBVHs" : "SAH BVHs") << " over " << triangle_count
+				  << " triangles of " << bottom_levels.size() << " shapes took " << duration.count() << "ms: "
+				  << node_count << " nodes, " << leaf_count << " leaves, depth " << max_depth << "\n";
+
+		build_top_level_acceleration_structure();
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::build_bottom_level(size_t shape)
+	{
+		blas<VB>& bottom_level = bottom_levels[shape];
+		bottom_level.triangles.clear();
+		for (size_t id = 0; id < index_buffers[shape]->count() / 3; ++id)
+		{
+			bottom_level.triangles.push_back(fetch_triangle(shape, id));
+		}
+		std::vector<triangle<VB>>& triangles = bottom_level.triangles;
+
+		std::vector<float3> triangle_min(triangles.size());
+		std::vector<float3> triangle_max(triangles.size());
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(triangles.size()); ++i)
+		{
+			triangle_min[i] = min(triangles[i].a, min(triangles[i].b, triangles[i].c));
+			triangle_max[i] = max(triangles[i].a, max(triangles[i].b, triangles[i].c));
+		}
+		bottom_level.triangle_bvh.build(triangle_min, triangle_max, builder);
+
+		// Leaves own contiguous ranges of triangles
+		std::vector<triangle<VB>> ordered_triangles;
+		ordered_triangles.reserve(triangles.size());
+		for (const unsigned int id: bottom_level.triangle_bvh.get_primitive_order())
+		{
+			ordered_triangles.push_back(triangles[id]);
+		}
+		triangles.swap(ordered_triangles);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::build_top_level_acceleration_structure()
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		std::vector<instance> candidates = instances;
+		if (candidates.empty())
+		{
+			for (size_t shape = 0; shape < bottom_levels.size(); ++shape)
+			{
+				candidates.push_back(instance{float3x4{{1.f, 0.f, 0.f}, {0.f, 1.f, 0.f}, {0.f, 0.f, 1.f}, {0.f, 0.f, 0.f}}, shape});
+			}
+		}
+		// Instances of shapes without triangles have no box
+		std::vector<instance> traced_instances;
+		for (const instance& candidate: candidates)
+		{
+			if (candidate.shape >= bottom_levels.size())
+			{
+				THROW_ERROR("Instance of a shape without acceleration structure");
+			}
+			if (!bottom_levels[candidate.shape].triangles.empty())
+			{
+				traced_instances.push_back(candidate);
+			}
+		}
+
+		// World boxes around the transformed corners of the shape boxes
+		std::vector<float3> instance_min(traced_instances.size());
+		std::vector<float3> instance_max(traced_instances.size());
+		#pragma omp parallel for
+		for (int i = 0; i < static_cast<int>(traced_instances.size()); ++i)
+		{
+			const bvh_node& root = bottom_levels[traced_instances[i].shape].triangle_bvh.get_nodes()[0];
+			instance_min[i] = float3{std::numeric_limits<float>::max()};
+			instance_max[i] = float3{std::numeric_limits<float>::lowest()};
+			for (int corner = 0; corner < 8; ++corner)
+			{
+				const float3 position{
+						corner & 1 ? root.aabb_max.x : root.aabb_min.x,
+						corner & 2 ? root.aabb_max.y : root.aabb_min.y,
+						corner & 4 ? root.aabb_max.z : root.aabb_min.z};
+				const float3 world_position = mul(traced_instances[i].transform, float4{position, 1.f});
+				instance_min[i] = min(instance_min[i], world_position);
+				instance_max[i] = max(instance_max[i], world_position);
+			}
+		}
+		top_level.build(instance_min, instance_max, builder);
+
+		scene_instances.clear();
+		for (const unsigned int id: top_level.get_primitive_order())
+		{
+			const float3x4& transform = traced_instances[id].transform;
+			const bool identity = transform[0] == float3{1.f, 0.f, 0.f} && transform[1] == float3{0.f, 1.f, 0.f} &&
+								  transform[2] == float3{0.f, 0.f, 1.f} && transform[3] == float3{0.f, 0.f, 0.f};
+			scene_instances.push_back(
+					traced_instance{transform, inverse_transform(transform), traced_instances[id].shape, identity});
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+
+		const bvh_statistics& statistics = top_level.get_statistics();
+		std::cout << "Top level over " << statistics.primitives << " instances took " << duration.count() << "ms: "
+				  << statistics.nodes << " nodes, depth " << statistics.max_depth
+				  << ", SAH cost " << statistics.sah_cost << "\n";
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::refit_acceleration_structure(float max_sah_cost_growth)
 	{
-		for (size_t i = 0; i < vertex_buffers.size(); ++i)
+		bool topology_changed = index_buffers.size() != bottom_levels.size();
+		for (size_t shape = 0; shape < bottom_levels.size() && !topology_changed; ++shape)
+		{
+			topology_changed = index_buffers[shape]->count() / 3 != bottom_levels[shape].triangles.size();
+		}
+		if (topology_changed)
+		{
+			THROW_ERROR("Refitting needs the topology of the last build");
+		}
+
+		auto start = std::chrono::high_resolution_clock::now();
+		size_t rebuilt = 0;
+		for (size_t shape = 0; shape < bottom_levels.size(); ++shape)
 		{
-			for (size_t j = 0; j < index_buffers[i]->count(); j += 3)
+			blas<VB>& bottom_level = bottom_levels[shape];
+			const std::vector<unsigned int>& order = bottom_level.triangle_bvh.get_primitive_order();
+			std::vector<float3> triangle_min(bottom_level.triangles.size());
+			std::vector<float3> triangle_max(bottom_level.triangles.size());
+			#pragma omp parallel for
+			for (int i = 0; i < static_cast<int>(bottom_level.triangles.size()); ++i)
+			{
+				const triangle<VB> tri = fetch_triangle(shape, order[i]);
+				bottom_level.triangles[i] = tri;
+				triangle_min[order[i]] = min(tri.a, min(tri.b, tri.c));
+				triangle_max[order[i]] = max(tri.a, max(tri.b, tri.c));
+			}
+			bottom_level.triangle_bvh.refit(triangle_min, triangle_max);
+
+			const bvh_statistics& statistics = bottom_level.triangle_bvh.get_statistics();
+			if (max_sah_cost_growth > 0.f && statistics.sah_cost > max_sah_cost_growth * statistics.build_sah_cost)
 			{
-				VB v0 = vertex_buffers[i]->item(index_buffers[i]->item(j));
-				VB v1 = vertex_buffers[i]->item(index_buffers[i]->item(j + 1));
-				VB v2 = vertex_buffers[i]->item(index_buffers[i]->item(j + 2));
-				triangle<VB> tri(v0, v1, v2);
-				triangles.push_back(tri);
+				build_bottom_level(shape);
+				++rebuilt;
 			}
 		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::chrono::duration<float, std::milli> duration = stop - start;
+		std::cout << "Refitting " << bottom_levels.size() << " shape BVHs took " << duration.count() << "ms, "
+				  << rebuilt << " of them rebuilt\n";
+
+		// Shape boxes changed, so the instance boxes did too
+		build_top_level_acceleration_structure();
 	}
 
-	template<typename VB, typename RT>
-	inline void raytracer<VB, RT>::ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num)
+	template<typename VB, typename RT, typename Layout>
+	inline const bvh& raytracer<VB, RT, Layout>::get_top_level_bvh() const
 	{
-		#pragma omp parallel for
-		for (int x = 0; x < width; x++)
+		return top_level;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline const bvh& raytracer<VB, RT, Layout>::get_bottom_level_bvh(size_t shape) const
+	{
+		return bottom_levels[shape].triangle_bvh;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline void raytracer<VB, RT, Layout>::ray_generation(float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num)
+	{
+		ray_generation(
+				position, direction, right, up, depth, accumulation_num,
+				miss_shader, closest_hit_shader, any_hit_shader);
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	template<typename MS, typename CHS, typename AHS>
+	inline void raytracer<VB, RT, Layout>::ray_generation(
+			float3 position, float3 direction, float3 right, float3 up, size_t depth, size_t accumulation_num,
+			const MS& miss, const CHS& closest_hit, const AHS& any_hit)
+	{
+		const float2 jitter = get_jitter(static_cast<int>(accumulation_num));
+		const float aspect_ratio = static_cast<float>(width) / static_cast<float>(height);
+		// Pixels are traced in small square tiles: neighbouring rays hit the same
+		// geometry and each tile's writes stay within a few lines of a tiled layout
+		const int tiles_x = static_cast<int>((width + TILE_SIZE - 1) / TILE_SIZE);
+		const int tiles_y = static_cast<int>((height + TILE_SIZE - 1) / TILE_SIZE);
+		#pragma omp parallel for schedule(dynamic)
+		for (int tile = 0; tile < tiles_x * tiles_y; tile++)
 		{
-			for (int y = 0; y < height; y++)
+			const int min_x = (tile % tiles_x) * TILE_SIZE;
+			const int min_y = (tile / tiles_x) * TILE_SIZE;
+			const int max_x = std::min(min_x + TILE_SIZE, static_cast<int>(width));
+			const int max_y = std::min(min_y + TILE_SIZE, static_cast<int>(height));
+			for (int y = min_y; y < max_y; y++)
 			{
-				float2 jitter = get_jitter(accumulation_num);
-				float u = (x + jitter.x) / width - 0.5f;
-				float v = (y + jitter.y) / height - 0.5f;
+				for (int x = min_x; x < max_x; x++)
+				{
+					float u = ((x + jitter.x) / width - 0.5f) * aspect_ratio;
+					float v = 0.5f - (y + jitter.y) / height;
 
-				float3 ray_dir = normalize(direction + u * right + v * up);
-				ray r(position, ray_dir);
-				payload p = trace_ray(r, depth);
+					float3 ray_dir = normalize(direction + u * right + v * up);
+					ray r(position, ray_dir);
+					payload p = trace_ray(r, depth, miss, closest_hit, any_hit);
 
-				render_target->item(x, y) = p.color;
+					render_target->item(x, y) = RT::from_color(p.color);
+				}
 			}
 		}
+		render_target_clear_pending = false;
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline payload raytracer<VB, RT, Layout>::trace_ray(const ray& ray, size_t depth, float max_t, float min_t) const
+	{
+		return trace_ray(ray, depth, miss_shader, closest_hit_shader, any_hit_shader, max_t, min_t);
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::trace_ray(const ray& ray, size_t depth, float max_t, float min_t) const
+	template<typename VB, typename RT, typename Layout>
+	template<typename MS, typename CHS, typename AHS>
+	inline payload raytracer<VB, RT, Layout>::trace_ray(
+			const ray& ray, size_t depth, const MS& miss, const CHS& closest_hit, const AHS& any_hit,
+			float max_t, float min_t) const
 	{
 		payload closest_payload;
 		closest_payload.t = max_t;
-		for (const auto& tri : triangles)
+		const triangle<VB>* closest_triangle = nullptr;
+		size_t closest_instance = 0;
+		bool any_hit_bound = false;
+		if constexpr (!std::is_same_v<AHS, std::nullptr_t>)
+		{
+			any_hit_bound = shader_bound(any_hit);
+		}
+		// closest_payload.t is the max_t of both levels, so closer hits shrink the search
+		top_level.traverse(ray.position, ray.direction, min_t, closest_payload.t, [&](unsigned int first, unsigned int count) {
+			for (unsigned int i = first; i < first + count; ++i)
+			{
+				const traced_instance& scene_instance = scene_instances[i];
+				const blas<VB>& bottom_level = bottom_levels[scene_instance.shape];
+				// The direction stays unnormalized, so t means the same in both spaces
+				auto object_ray = ray;
+				if (!scene_instance.identity)
+				{
+					object_ray.position = mul(scene_instance.to_object, float4{ray.position, 1.f});
+					object_ray.direction = mul(scene_instance.to_object, float4{ray.direction, 0.f});
+				}
+				bool any_hit_found = false;
+				bottom_level.triangle_bvh.traverse(
+						object_ray.position, object_ray.direction, min_t, closest_payload.t,
+						[&](unsigned int triangle_first, unsigned int triangle_count) {
+							for (unsigned int j = triangle_first; j < triangle_first + triangle_count; ++j)
+							{
+								payload p = intersection_shader(bottom_level.triangles[j], object_ray);
+								if (p.t > min_t && p.t < closest_payload.t)
+								{
+									closest_payload = p;
+									closest_triangle = &bottom_level.triangles[j];
+									closest_instance = i;
+									// Any hit ends the trace
+									if (any_hit_bound)
+									{
+										any_hit_found = true;
+										return true;
+									}
+								}
+							}
+							return false;
+						});
+				if (any_hit_found)
+				{
+					return true;
+				}
+			}
+			return false;
+		});
+		if (!closest_triangle)
 		{
-			payload p = intersection_shader(tri, ray);
-			if (p.t > min_t && p.t < closest_payload.t)
+			if constexpr (!std::is_same_v<MS, std::nullptr_t>)
 			{
-				closest_payload = p;
-				if (any_hit_shader)
+				if (shader_bound(miss))
 				{
-					return any_hit_shader(ray, closest_payload, tri);
+					return miss(ray);
 				}
 			}
+			return closest_payload;
+		}
+		// Shaders see the triangle in world space
+		const traced_instance& hit_instance = scene_instances[closest_instance];
+		std::optional<triangle<VB>> world_triangle;
+		if (!hit_instance.identity)
+		{
+			world_triangle = transform_triangle(*closest_triangle, hit_instance.to_world, hit_instance.to_object);
+			closest_triangle = &*world_triangle;
+		}
+		if constexpr (!std::is_same_v<AHS, std::nullptr_t>)
+		{
+			if (any_hit_bound)
+			{
+				return any_hit(ray, closest_payload, *closest_triangle);
+			}
 		}
-		if (closest_payload.t == max_t && miss_shader)
+		if constexpr (!std::is_same_v<CHS, std::nullptr_t>)
 		{
-			return miss_shader(ray);
+			if (shader_bound(closest_hit))
+			{
+				return closest_hit(ray, closest_payload, *closest_triangle, depth);
+			}
 		}
 		return closest_payload;
 	}
 
-	template<typename VB, typename RT>
-	inline payload raytracer<VB, RT>::intersection_shader(const triangle<VB>& triangle, const ray& ray) const
+	template<typename VB, typename RT, typename Layout>
+	inline triangle<VB> raytracer<VB, RT, Layout>::fetch_triangle(size_t shape, size_t id) const
+	{
+		const size_t index = 3 * id;
+		const auto& vertex_buffer = vertex_buffers[shape];
+		const auto& index_buffer = index_buffers[shape];
+		return triangle<VB>(
+				vertex_buffer->item(index_buffer->item(index)),
+				vertex_buffer->item(index_buffer->item(index + 1)),
+				vertex_buffer->item(index_buffer->item(index + 2)));
+	}
+
+	template<typename VB, typename RT, typename Layout>
+	inline payload raytracer<VB, RT, Layout>::intersection_shader(const triangle<VB>& triangle, const ray& ray) const
 	{
 		float3 pvec = cross(ray.direction, triangle.ca);
 		float det = dot(triangle.ba, pvec);
@@ -282,11 +668,11 @@ namespace cg::renderer
 		if (v < 0 || u + v > 1) return payload{};
 
 		float t = dot(triangle.ca, qvec) * inv_det;
-		return payload{t, float3{u, v, 1 - u - v}, triangle.diffuse};
+		return payload{t, float3{1 - u - v, u, v}, color::from_float3(triangle.diffuse)};
 	}
 
-	template<typename VB, typename RT>
-	inline float2 raytracer<VB, RT>::get_jitter(int frame_id)
+	template<typename VB, typename RT, typename Layout>
+	inline float2 raytracer<VB, RT, Layout>::get_jitter(int frame_id)
 	{
 		std::mt19937 gen(frame_id);
 		std::uniform_real_distribution<float> dis(0.0f, 1.0f);
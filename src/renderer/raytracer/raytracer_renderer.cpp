@@ -1,19 +1,48 @@
 #include "raytracer_renderer.h"
 
+#include "utils/error_handler.h"
 #include "utils/resource_utils.h"
 
+#include <chrono>
 #include <iostream>
 
 
 void cg::renderer::ray_tracing_renderer::init()
 {
-	render_target = std::make_shared<resource<unsigned_color>>(width, height);
-	camera = std::make_shared<world::camera>();
-
-	raytracer = std::make_shared<raytracer<vertex, unsigned_color>>();
+	render_target = std::make_shared<resource<unsigned_color>>(settings->width, settings->height);
+
+	model = std::make_shared<cg::world::model>();
+	model->load_obj(settings->model_path);
+
+	camera = std::make_shared<cg::world::camera>();
+	camera->set_height(static_cast<float>(settings->height));
+	camera->set_width(static_cast<float>(settings->width));
+	camera->set_position(float3{
+			settings->camera_position[0],
+			settings->camera_position[1],
+			settings->camera_position[2]});
+	camera->set_theta(settings->camera_theta);
+	camera->set_phi(settings->camera_phi);
+	camera->set_angle_of_view(settings->camera_angle_of_view);
+	camera->set_z_near(settings->camera_z_near);
+	camera->set_z_far(settings->camera_z_far);
+
+	bvh_builder builder = bvh_builder::sah;
+	if (settings->raytracing_bvh_builder == "lbvh")
+	{
+		builder = bvh_builder::lbvh;
+	}
+	else if (settings->raytracing_bvh_builder != "sah")
+	{
+		THROW_ERROR("Unknown BVH builder " + settings->raytracing_bvh_builder);
+	}
+
+	raytracer = std::make_shared<cg::renderer::raytracer<vertex, unsigned_color>>();
 	raytracer->set_render_target(render_target);
-	raytracer->set_viewport(width, height);
-
+	raytracer->set_viewport(settings->width, settings->height);
+	raytracer->set_vertex_buffers(model->get_vertex_buffers());
+	raytracer->set_index_buffers(model->get_index_buffers());
+	raytracer->set_bvh_builder(builder);
 	raytracer->build_acceleration_structure();
 
 	lights.push_back({float3{5.0f, 5.0f, 5.0f}, float3{1.0f, 1.0f, 1.0f}});
@@ -25,24 +54,32 @@ void cg::renderer::ray_tracing_renderer::update() {}
 
 void cg::renderer::ray_tracing_renderer::render()
 {
-	raytracer->miss_shader = [](const ray& ray) -> payload {
-		return payload{.color = color{0.3f, 0.5f, 0.7f}};
+	auto miss_shader = [](const ray&) -> payload {
+		return payload{0.f, float3{0.f, 0.f, 0.f}, color{0.3f, 0.5f, 0.7f}};
+	};
+
+	auto shadow_any_hit_shader = [](const ray&, payload& p, const triangle<vertex>&) -> payload {
+		p.t = 0.0f;
+		return p;
 	};
 
-	raytracer->closest_hit_shader = [this](const ray& ray, payload& p, const triangle<vertex>& tri, size_t depth) -> payload {
+	auto closest_hit_shader = [&](const ray& ray, payload& p, const triangle<vertex>& tri, size_t depth) -> payload {
 		float3 hit_position = ray.position + ray.direction * p.t;
 		float3 normal = normalize(p.bary.x * tri.na + p.bary.y * tri.nb + p.bary.z * tri.nc);
 
-		float3 final_color = tri.ambient;
+		float3 final_color = tri.ambient + tri.emissive;
 
 		for (const auto& light : lights)
 		{
-			ray shadow_ray(hit_position, light.position - hit_position);
-			payload shadow_payload = shadow_raytracer->trace_ray(shadow_ray, depth);
+			const float light_distance = length(light.position - hit_position);
+			cg::renderer::ray shadow_ray(hit_position, light.position - hit_position);
+			// Shadow rays share the acceleration structure, only the shaders differ
+			payload shadow_payload = raytracer->trace_ray(
+					shadow_ray, depth, nullptr, nullptr, shadow_any_hit_shader, light_distance);
 
-			if (shadow_payload.t >= length(light.position - hit_position)) {
+			if (shadow_payload.t >= light_distance) {
 				float3 light_direction = normalize(light.position - hit_position);
-				float intensity = max(dot(normal, light_direction), 0.0f);
+				float intensity = std::max(dot(normal, light_direction), 0.0f);
 				final_color += tri.diffuse * light.color * intensity;
 			}
 		}
@@ -51,14 +88,17 @@ void cg::renderer::ray_tracing_renderer::render()
 		return p;
 	};
 
-	shadow_raytracer->any_hit_shader = [](const ray& ray, payload& payload, const triangle<vertex>& triangle) -> payload {
-		payload.t = 0.0f;
-		return payload;
-	};
-
 	raytracer->clear_render_target(unsigned_color{0, 0, 0});
-	raytracer->ray_generation(camera->get_position(), camera->get_direction(), camera->get_right(), camera->get_up(), 3, 1);
 
-	utils::save_resource(*render_target, "output.png");
+	auto start = std::chrono::high_resolution_clock::now();
+	raytracer->ray_generation(
+			camera->get_position(), camera->get_direction(), camera->get_right(), camera->get_up(),
+			settings->raytracing_depth, settings->accumulation_num,
+			miss_shader, closest_hit_shader, nullptr);
+	auto stop = std::chrono::high_resolution_clock::now();
+	std::chrono::duration<float, std::milli> duration = stop - start;
+	std::cout << "Raytracing took " << duration.count() << "ms\n";
+
+	raytracer->resolve();
+	utils::save_resource(*render_target, settings->result_path);
 }
-
@@ -0,0 +1,621 @@
+#pragma once
+
+#include "resource.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+
+namespace cg::renderer
+{
+	enum class texture_format
+	{
+		// Texels packed as r | g << 8 | b << 16 | a << 24
+		rgba8,
+		// 4x4 blocks of two RGB565 endpoints and 2-bit indices, 8 bytes per block. Opaque only.
+		bc1,
+		// A block of two alpha endpoints and 3-bit indices followed by a BC1 color block, 16 bytes
+		bc3
+	};
+
+	// Texture with a box-filtered mip chain built at load time. Block-compressed
+	// formats are encoded once here and decoded by the sampler on access.
+	// All levels share one allocation, so one gather can read two levels.
+	class texture
+	{
+	public:
+		texture(size_t width, size_t height, const unsigned char* rgba, texture_format in_format = texture_format::rgba8);
+		~texture(){};
+
+		texture_format get_format() const;
+		size_t get_mip_count() const;
+		size_t get_width(size_t level = 0) const;
+		size_t get_height(size_t level = 0) const;
+		// Position of the level's first texel in get_texels()
+		size_t get_offset(size_t level) const;
+		// Only for rgba8
+		const unsigned int* get_texels() const;
+		size_t get_memory_size() const;
+
+		// Unique per texture, so caches never confuse a freed texture with a new one at the same address
+		size_t get_id() const;
+		// Index of the block holding the texel over all levels
+		size_t get_block_index(size_t level, size_t x, size_t y) const;
+		void decode_block(size_t block_index, unsigned int (&block_texels)[16]) const;
+
+		static unsigned int pack(const unsigned char* rgba);
+
+	protected:
+		struct mip_level
+		{
+			size_t width;
+			size_t height;
+			size_t offset;
+			size_t block_offset;
+		};
+		std::vector<mip_level> levels;
+		texture_format format;
+		size_t id;
+		std::shared_ptr<resource<unsigned int>> texels;
+		std::shared_ptr<resource<uint64_t>> blocks;
+
+		static size_t blocks_per_row(size_t width);
+		static uint64_t encode_color_block(const unsigned int (&block_texels)[16]);
+		static uint64_t encode_alpha_block(const unsigned int (&block_texels)[16]);
+		static void decode_color_block(uint64_t block, bool allow_transparent, unsigned int (&block_texels)[16]);
+		static void decode_alpha_block(uint64_t block, unsigned int (&block_texels)[16]);
+	};
+
+	enum class texture_filter
+	{
+		// Four taps from the nearest mip level
+		bilinear,
+		// Four taps from each of the two nearest levels
+		trilinear
+	};
+
+	// Samples with wrap-around addressing. The taps of one lookup are fetched
+	// and weighted together with AVX2 when available.
+	class sampler
+	{
+	public:
+		sampler(texture_filter in_filter = texture_filter::trilinear) : filter(in_filter){};
+
+		// The level of detail comes from the texture coordinate derivatives along screen x and y
+		float4 sample(const texture& image, float2 uv, float2 ddx, float2 ddy) const;
+		float4 sample_level(const texture& image, float2 uv, float lod) const;
+
+		texture_filter filter;
+
+	protected:
+		static constexpr int MAX_TAPS = 8;
+		// Decoded blocks kept per thread, direct mapped
+		static constexpr int BLOCK_CACHE_BITS = 6;
+		static void add_bilinear_taps(
+				const texture& image, size_t level, float2 uv, float level_weight, int2* texel, float* weight);
+		static unsigned int fetch_compressed(const texture& image, size_t level, int2 texel);
+		static float4 accumulate(const unsigned int* texels, const int (&index)[MAX_TAPS], const float (&weight)[MAX_TAPS]);
+	};
+
+	inline texture::texture(size_t width, size_t height, const unsigned char* rgba, texture_format in_format)
+			: format(in_format)
+	{
+		static std::atomic<size_t> next_id{0};
+		id = next_id++;
+
+		size_t total = 0;
+		size_t total_blocks = 0;
+		for (size_t w = std::max(width, size_t{1}), h = std::max(height, size_t{1});; w = std::max(w / 2, size_t{1}), h = std::max(h / 2, size_t{1}))
+		{
+			levels.push_back(mip_level{w, h, total, total_blocks});
+			total += w * h;
+			total_blocks += blocks_per_row(w) * blocks_per_row(h);
+			if (w == 1 && h == 1)
+			{
+				break;
+			}
+		}
+		texels = std::make_shared<resource<unsigned int>>(total);
+		unsigned int* chain = &texels->item(0);
+
+		for (size_t i = 0; i < width * height; ++i)
+		{
+			chain[i] = pack(rgba + 4 * i);
+		}
+		for (size_t level = 1; level < levels.size(); ++level)
+		{
+			const mip_level& source = levels[level - 1];
+			const mip_level& target = levels[level];
+			for (size_t y = 0; y < target.height; ++y)
+			{
+				for (size_t x = 0; x < target.width; ++x)
+				{
+					// Odd sizes repeat the last row or column
+					const size_t x0 = std::min(2 * x, source.width - 1);
+					const size_t x1 = std::min(2 * x + 1, source.width - 1);
+					const size_t y0 = std::min(2 * y, source.height - 1);
+					const size_t y1 = std::min(2 * y + 1, source.height - 1);
+					const unsigned int corners[4] = {
+							chain[source.offset + y0 * source.width + x0],
+							chain[source.offset + y0 * source.width + x1],
+							chain[source.offset + y1 * source.width + x0],
+							chain[source.offset + y1 * source.width + x1]};
+					unsigned char average[4];
+					for (int channel = 0; channel < 4; ++channel)
+					{
+						unsigned int sum = 2;
+						for (const unsigned int corner: corners)
+						{
+							sum += (corner >> (8 * channel)) & 0xff;
+						}
+						average[channel] = static_cast<unsigned char>(sum / 4);
+					}
+					chain[target.offset + y * target.width + x] = pack(average);
+				}
+			}
+		}
+		if (format == texture_format::rgba8)
+		{
+			return;
+		}
+
+		const size_t words_per_block = format == texture_format::bc3 ? 2 : 1;
+		blocks = std::make_shared<resource<uint64_t>>(total_blocks * words_per_block);
+		uint64_t* block_data = &blocks->item(0);
+		for (const mip_level& level: levels)
+		{
+			const int blocks_x = static_cast<int>(blocks_per_row(level.width));
+			const int blocks_y = static_cast<int>(blocks_per_row(level.height));
+			#pragma omp parallel for
+			for (int block_y = 0; block_y < blocks_y; ++block_y)
+			{
+				for (int block_x = 0; block_x < blocks_x; ++block_x)
+				{
+					// Blocks past the level's edge repeat its last row or column
+					unsigned int block_texels[16];
+					for (size_t i = 0; i < 16; ++i)
+					{
+						const size_t x = std::min(block_x * size_t{4} + i % 4, level.width - 1);
+						const size_t y = std::min(block_y * size_t{4} + i / 4, level.height - 1);
+						block_texels[i] = chain[level.offset + y * level.width + x];
+					}
+					uint64_t* block = block_data + (level.block_offset + block_y * blocks_x + block_x) * words_per_block;
+					if (format == texture_format::bc3)
+					{
+						*block++ = encode_alpha_block(block_texels);
+					}
+					*block = encode_color_block(block_texels);
+				}
+			}
+		}
+		texels.reset();
+	}
+
+	inline texture_format texture::get_format() const
+	{
+		return format;
+	}
+
+	inline size_t texture::get_mip_count() const
+	{
+		return levels.size();
+	}
+
+	inline size_t texture::get_width(size_t level) const
+	{
+		return levels[level].width;
+	}
+
+	inline size_t texture::get_height(size_t level) const
+	{
+		return levels[level].height;
+	}
+
+	inline size_t texture::get_offset(size_t level) const
+	{
+		return levels[level].offset;
+	}
+
+	inline const unsigned int* texture::get_texels() const
+	{
+		return texels ? texels->get_data() : nullptr;
+	}
+
+	inline size_t texture::get_memory_size() const
+	{
+		return texels ? texels->size_bytes() : blocks->size_bytes();
+	}
+
+	inline size_t texture::get_id() const
+	{
+		return id;
+	}
+
+	inline size_t texture::get_block_index(size_t level, size_t x, size_t y) const
+	{
+		const mip_level& mip = levels[level];
+		return mip.block_offset + (y / 4) * blocks_per_row(mip.width) + x / 4;
+	}
+
+	inline void texture::decode_block(size_t block_index, unsigned int (&block_texels)[16]) const
+	{
+		const uint64_t* block = blocks->get_data() + block_index * (format == texture_format::bc3 ? 2 : 1);
+		if (format == texture_format::bc3)
+		{
+			decode_color_block(block[1], false, block_texels);
+			decode_alpha_block(block[0], block_texels);
+		}
+		else
+		{
+			decode_color_block(block[0], true, block_texels);
+		}
+	}
+
+	inline unsigned int texture::pack(const unsigned char* rgba)
+	{
+		return static_cast<unsigned int>(rgba[0]) | static_cast<unsigned int>(rgba[1]) << 8 |
+			   static_cast<unsigned int>(rgba[2]) << 16 | static_cast<unsigned int>(rgba[3]) << 24;
+	}
+
+	inline size_t texture::blocks_per_row(size_t width)
+	{
+		return (width + 3) / 4;
+	}
+
+	namespace bc
+	{
+		inline unsigned int to_565(const int (&rgb)[3])
+		{
+			return static_cast<unsigned int>((rgb[0] >> 3) << 11 | (rgb[1] >> 2) << 5 | rgb[2] >> 3);
+		}
+
+		inline void from_565(unsigned int color, int (&rgb)[3])
+		{
+			const int r = (color >> 11) & 31;
+			const int g = (color >> 5) & 63;
+			const int b = color & 31;
+			rgb[0] = r << 3 | r >> 2;
+			rgb[1] = g << 2 | g >> 4;
+			rgb[2] = b << 3 | b >> 2;
+		}
+
+		// Endpoints and the two colors between them, as in the 4-color mode
+		inline void color_palette(unsigned int color0, unsigned int color1, int (&palette)[4][3])
+		{
+			from_565(color0, palette[0]);
+			from_565(color1, palette[1]);
+			for (int channel = 0; channel < 3; ++channel)
+			{
+				palette[2][channel] = (2 * palette[0][channel] + palette[1][channel]) / 3;
+				palette[3][channel] = (palette[0][channel] + 2 * palette[1][channel]) / 3;
+			}
+		}
+	}// namespace bc
+
+	inline uint64_t texture::encode_color_block(const unsigned int (&block_texels)[16])
+	{
+		// Bounding box of the colors, inset by 1/16 so the endpoints land near the
+		// actual extremes instead of on outliers
+		int min_rgb[3] = {255, 255, 255};
+		int max_rgb[3] = {0, 0, 0};
+		for (const unsigned int texel: block_texels)
+		{
+			for (int channel = 0; channel < 3; ++channel)
+			{
+				const int value = (texel >> (8 * channel)) & 0xff;
+				min_rgb[channel] = std::min(min_rgb[channel], value);
+				max_rgb[channel] = std::max(max_rgb[channel], value);
+			}
+		}
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			const int inset = (max_rgb[channel] - min_rgb[channel]) / 16;
+			min_rgb[channel] += inset;
+			max_rgb[channel] -= inset;
+		}
+
+		// The box diagonal follows the widest channel; channels falling while it rises swap ends
+		int widest = 0;
+		for (int channel = 1; channel < 3; ++channel)
+		{
+			if (max_rgb[channel] - min_rgb[channel] > max_rgb[widest] - min_rgb[widest])
+			{
+				widest = channel;
+			}
+		}
+		int covariance[3] = {};
+		for (const unsigned int texel: block_texels)
+		{
+			const int delta = static_cast<int>((texel >> (8 * widest)) & 0xff) * 2 - min_rgb[widest] - max_rgb[widest];
+			for (int channel = 0; channel < 3; ++channel)
+			{
+				covariance[channel] += delta * (static_cast<int>((texel >> (8 * channel)) & 0xff) * 2 - min_rgb[channel] - max_rgb[channel]);
+			}
+		}
+		for (int channel = 0; channel < 3; ++channel)
+		{
+			if (covariance[channel] < 0)
+			{
+				std::swap(min_rgb[channel], max_rgb[channel]);
+			}
+		}
+
+		// The larger endpoint goes first, which selects the 4-color mode
+		unsigned int color0 = bc::to_565(max_rgb);
+		unsigned int color1 = bc::to_565(min_rgb);
+		if (color0 < color1)
+		{
+			std::swap(color0, color1);
+		}
+		uint64_t block = color0 | color1 << 16;
+		if (color0 == color1)
+		{
+			return block;
+		}
+
+		int palette[4][3];
+		bc::color_palette(color0, color1, palette);
+		for (int i = 0; i < 16; ++i)
+		{
+			int best_index = 0;
+			int best_distance = std::numeric_limits<int>::max();
+			for (int index = 0; index < 4; ++index)
+			{
+				int distance = 0;
+				for (int channel = 0; channel < 3; ++channel)
+				{
+					const int delta = static_cast<int>((block_texels[i] >> (8 * channel)) & 0xff) - palette[index][channel];
+					distance += delta * delta;
+				}
+				if (distance < best_distance)
+				{
+					best_distance = distance;
+					best_index = index;
+				}
+			}
+			block |= static_cast<uint64_t>(best_index) << (32 + 2 * i);
+		}
+		return block;
+	}
+
+	inline uint64_t texture::encode_alpha_block(const unsigned int (&block_texels)[16])
+	{
+		int min_alpha = 255;
+		int max_alpha = 0;
+		for (const unsigned int texel: block_texels)
+		{
+			min_alpha = std::min(min_alpha, static_cast<int>(texel >> 24));
+			max_alpha = std::max(max_alpha, static_cast<int>(texel >> 24));
+		}
+		uint64_t block = static_cast<uint64_t>(max_alpha) | static_cast<uint64_t>(min_alpha) << 8;
+		if (max_alpha == min_alpha)
+		{
+			return block;
+		}
+
+		// 8-value mode: the nearest of 8 evenly spaced steps from max to min. Step 0 is
+		// index 0, step 7 is index 1 and the steps between are indices 2 to 7.
+		const int range = max_alpha - min_alpha;
+		for (int i = 0; i < 16; ++i)
+		{
+			const int step = ((max_alpha - static_cast<int>(block_texels[i] >> 24)) * 7 + range / 2) / range;
+			const uint64_t index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+			block |= index << (16 + 3 * i);
+		}
+		return block;
+	}
+
+	inline void texture::decode_color_block(uint64_t block, bool allow_transparent, unsigned int (&block_texels)[16])
+	{
+		const unsigned int color0 = block & 0xffff;
+		const unsigned int color1 = (block >> 16) & 0xffff;
+		int palette[4][3];
+		bc::color_palette(color0, color1, palette);
+		unsigned int alpha[4] = {255, 255, 255, 255};
+		if (allow_transparent && color0 <= color1)
+		{
+			// 3-color mode: one midpoint and transparent black
+			for (int channel = 0; channel < 3; ++channel)
+			{
+				palette[2][channel] = (palette[0][channel] + palette[1][channel]) / 2;
+				palette[3][channel] = 0;
+			}
+			alpha[3] = 0;
+		}
+
+		unsigned int packed[4];
+		for (int index = 0; index < 4; ++index)
+		{
+			packed[index] = static_cast<unsigned int>(palette[index][0]) | static_cast<unsigned int>(palette[index][1]) << 8 |
+							static_cast<unsigned int>(palette[index][2]) << 16 | alpha[index] << 24;
+		}
+		for (int i = 0; i < 16; ++i)
+		{
+			block_texels[i] = packed[(block >> (32 + 2 * i)) & 3];
+		}
+	}
+
+	inline void texture::decode_alpha_block(uint64_t block, unsigned int (&block_texels)[16])
+	{
+		const int alpha0 = block & 0xff;
+		const int alpha1 = (block >> 8) & 0xff;
+		unsigned int palette[8] = {static_cast<unsigned int>(alpha0), static_cast<unsigned int>(alpha1)};
+		if (alpha0 > alpha1)
+		{
+			for (int step = 1; step < 7; ++step)
+			{
+				palette[step + 1] = static_cast<unsigned int>(((7 - step) * alpha0 + step * alpha1) / 7);
+			}
+		}
+		else
+		{
+			for (int step = 1; step < 5; ++step)
+			{
+				palette[step + 1] = static_cast<unsigned int>(((5 - step) * alpha0 + step * alpha1) / 5);
+			}
+			palette[6] = 0;
+			palette[7] = 255;
+		}
+		for (int i = 0; i < 16; ++i)
+		{
+			block_texels[i] = (block_texels[i] & 0x00ffffff) | palette[(block >> (16 + 3 * i)) & 7] << 24;
+		}
+	}
+
+	inline float4 sampler::sample(const texture& image, float2 uv, float2 ddx, float2 ddy) const
+	{
+		const float2 size{static_cast<float>(image.get_width()), static_cast<float>(image.get_height())};
+		const float2 texel_ddx = ddx * size;
+		const float2 texel_ddy = ddy * size;
+		// log2 of the longer footprint axis, taken on squared lengths
+		const float lod = 0.5f * std::log2(std::max(dot(texel_ddx, texel_ddx), dot(texel_ddy, texel_ddy)));
+		return sample_level(image, uv, lod);
+	}
+
+	inline float4 sampler::sample_level(const texture& image, float2 uv, float lod) const
+	{
+		const float max_lod = static_cast<float>(image.get_mip_count() - 1);
+		// Also catches NaN from degenerate derivatives
+		lod = lod > 0.f ? std::min(lod, max_lod) : 0.f;
+
+		int2 texel[MAX_TAPS] = {};
+		float weight[MAX_TAPS] = {};
+		size_t level[2] = {static_cast<size_t>(lod), static_cast<size_t>(lod)};
+		if (filter == texture_filter::bilinear)
+		{
+			level[0] = level[1] = static_cast<size_t>(lod + 0.5f);
+			add_bilinear_taps(image, level[0], uv, 1.f, texel, weight);
+		}
+		else
+		{
+			const float blend = lod - static_cast<float>(level[0]);
+			add_bilinear_taps(image, level[0], uv, 1.f - blend, texel, weight);
+			if (blend > 0.f)
+			{
+				level[1] = level[0] + 1;
+				add_bilinear_taps(image, level[1], uv, blend, texel + 4, weight + 4);
+			}
+		}
+
+		int index[MAX_TAPS];
+		if (image.get_format() == texture_format::rgba8)
+		{
+			for (int tap = 0; tap < MAX_TAPS; ++tap)
+			{
+				const size_t tap_level = level[tap / 4];
+				index[tap] = static_cast<int>(image.get_offset(tap_level) + texel[tap].y * image.get_width(tap_level) + texel[tap].x);
+			}
+			return accumulate(image.get_texels(), index, weight);
+		}
+
+		unsigned int decoded[MAX_TAPS];
+		for (int tap = 0; tap < MAX_TAPS; ++tap)
+		{
+			// Unused taps have zero weight, skip decoding for them
+			decoded[tap] = weight[tap] != 0.f ? fetch_compressed(image, level[tap / 4], texel[tap]) : 0;
+			index[tap] = tap;
+		}
+		return accumulate(decoded, index, weight);
+	}
+
+	inline void sampler::add_bilinear_taps(
+			const texture& image, size_t level, float2 uv, float level_weight, int2* texel, float* weight)
+	{
+		const int width = static_cast<int>(image.get_width(level));
+		const int height = static_cast<int>(image.get_height(level));
+		const float x = (uv.x - std::floor(uv.x)) * width - 0.5f;
+		const float y = (uv.y - std::floor(uv.y)) * height - 0.5f;
+		const float x_floor = std::floor(x);
+		const float y_floor = std::floor(y);
+		const float ax = x - x_floor;
+		const float ay = y - y_floor;
+
+		int x0 = static_cast<int>(x_floor);
+		int y0 = static_cast<int>(y_floor);
+		int x1 = x0 + 1;
+		int y1 = y0 + 1;
+		x0 = x0 < 0 ? x0 + width : x0;
+		y0 = y0 < 0 ? y0 + height : y0;
+		x1 = x1 >= width ? x1 - width : x1;
+		y1 = y1 >= height ? y1 - height : y1;
+
+		texel[0] = int2{x0, y0};
+		texel[1] = int2{x1, y0};
+		texel[2] = int2{x0, y1};
+		texel[3] = int2{x1, y1};
+		weight[0] = (1.f - ax) * (1.f - ay) * level_weight;
+		weight[1] = ax * (1.f - ay) * level_weight;
+		weight[2] = (1.f - ax) * ay * level_weight;
+		weight[3] = ax * ay * level_weight;
+	}
+
+	inline unsigned int sampler::fetch_compressed(const texture& image, size_t level, int2 texel)
+	{
+		struct decoded_block
+		{
+			size_t texture_id = ~size_t{0};
+			size_t block_index = 0;
+			unsigned int texels[16];
+		};
+		// Bilinear taps mostly share one block and neighbouring pixels reuse it
+		static thread_local decoded_block cache[1 << BLOCK_CACHE_BITS];
+
+		const size_t block_index = image.get_block_index(level, texel.x, texel.y);
+		const uint32_t hash = static_cast<uint32_t>(block_index * 2654435761u + image.get_id() * 40503u);
+		decoded_block& entry = cache[hash >> (32 - BLOCK_CACHE_BITS)];
+		if (entry.texture_id != image.get_id() || entry.block_index != block_index)
+		{
+			image.decode_block(block_index, entry.texels);
+			entry.texture_id = image.get_id();
+			entry.block_index = block_index;
+		}
+		return entry.texels[(texel.y % 4) * 4 + texel.x % 4];
+	}
+
+	inline float4 sampler::accumulate(
+			const unsigned int* texels, const int (&index)[MAX_TAPS], const float (&weight)[MAX_TAPS])
+	{
+#ifdef __AVX2__
+		const __m256i gathered = _mm256_i32gather_epi32(
+				reinterpret_cast<const int*>(texels), _mm256_loadu_si256(reinterpret_cast<const __m256i*>(index)), 4);
+		const __m256 weights = _mm256_loadu_ps(weight);
+		const __m128i halves[2] = {_mm256_castsi256_si128(gathered), _mm256_extracti128_si256(gathered, 1)};
+
+		// Each step widens two texels to [r g b a r g b a] and weights them
+		__m256 sum = _mm256_setzero_ps();
+		for (int pair = 0; pair < MAX_TAPS / 2; ++pair)
+		{
+			const __m128i bytes = pair % 2 ? _mm_srli_si128(halves[pair / 2], 8) : halves[pair / 2];
+			const __m256 channels = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes));
+			const __m256 pair_weights = _mm256_permutevar8x32_ps(
+					weights, _mm256_setr_epi32(2 * pair, 2 * pair, 2 * pair, 2 * pair,
+											   2 * pair + 1, 2 * pair + 1, 2 * pair + 1, 2 * pair + 1));
+			sum = _mm256_add_ps(sum, _mm256_mul_ps(channels, pair_weights));
+		}
+		const __m128 rgba = _mm_mul_ps(
+				_mm_add_ps(_mm256_castps256_ps128(sum), _mm256_extractf128_ps(sum, 1)), _mm_set1_ps(1.f / 255.f));
+		alignas(16) float result[4];
+		_mm_store_ps(result, rgba);
+		return float4{result[0], result[1], result[2], result[3]};
+#else
+		float4 sum{0.f, 0.f, 0.f, 0.f};
+		for (int tap = 0; tap < MAX_TAPS; ++tap)
+		{
+			const unsigned int texel = texels[index[tap]];
+			sum += weight[tap] * float4{
+					static_cast<float>(texel & 0xff), static_cast<float>((texel >> 8) & 0xff),
+					static_cast<float>((texel >> 16) & 0xff), static_cast<float>(texel >> 24)};
+		}
+		return sum * (1.f / 255.f);
+#endif
+	}
+}// namespace cg::renderer
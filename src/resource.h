@@ -3,7 +3,9 @@
 #include "utils/error_handler.h"
 
 #include <algorithm>
+#include <cstdint>
 #include <linalg.h>
+#include <type_traits>
 #include <vector>
 
 
@@ -11,17 +13,90 @@ using namespace linalg::aliases;
 
 namespace cg
 {
-	template<typename T>
+	// Storage orders of 2D resources. Within a row, `row_run` items starting at
+	// a multiple of `row_run` are always contiguous in memory.
+	struct linear_layout
+	{
+		// Any part of a row
+		static constexpr size_t row_run = size_t{1} << 30;
+
+		static size_t allocation(size_t width, size_t height)
+		{
+			return width * height;
+		}
+		static size_t offset(size_t x, size_t y, size_t width)
+		{
+			return y * width + x;
+		}
+	};
+
+	// Square tiles stored one after another, rows of tiles in order
+	template<size_t TILE_SIZE = 8>
+	struct tiled_layout
+	{
+		static_assert(TILE_SIZE && (TILE_SIZE & (TILE_SIZE - 1)) == 0, "Tile size must be a power of two");
+		static constexpr size_t row_run = TILE_SIZE;
+
+		static size_t allocation(size_t width, size_t height)
+		{
+			return tiles(width) * tiles(height) * TILE_SIZE * TILE_SIZE;
+		}
+		static size_t offset(size_t x, size_t y, size_t width)
+		{
+			const size_t tile = (y / TILE_SIZE) * tiles(width) + x / TILE_SIZE;
+			return tile * TILE_SIZE * TILE_SIZE + (y % TILE_SIZE) * TILE_SIZE + x % TILE_SIZE;
+		}
+		static size_t tiles(size_t size)
+		{
+			return (size + TILE_SIZE - 1) / TILE_SIZE;
+		}
+	};
+
+	// Z-order inside square blocks, blocks stored like tiles of `tiled_layout`.
+	// Whole-image Morton order would pad both sides to one power of two.
+	template<size_t BLOCK_SIZE = 64>
+	struct morton_layout
+	{
+		static_assert(BLOCK_SIZE && (BLOCK_SIZE & (BLOCK_SIZE - 1)) == 0, "Block size must be a power of two");
+		static_assert(BLOCK_SIZE <= 65536, "Block coordinates must fit 16 bits");
+		static constexpr size_t row_run = 2;
+
+		static size_t allocation(size_t width, size_t height)
+		{
+			return tiled_layout<BLOCK_SIZE>::allocation(width, height);
+		}
+		static size_t offset(size_t x, size_t y, size_t width)
+		{
+			const size_t block = (y / BLOCK_SIZE) * tiled_layout<BLOCK_SIZE>::tiles(width) + x / BLOCK_SIZE;
+			return block * BLOCK_SIZE * BLOCK_SIZE + (spread_bits(x % BLOCK_SIZE) | (spread_bits(y % BLOCK_SIZE) << 1));
+		}
+		// Moves bit i of a 16-bit value to bit 2i
+		static size_t spread_bits(size_t value)
+		{
+			uint32_t bits = static_cast<uint32_t>(value);
+			bits = (bits | (bits << 8)) & 0x00ff00ffu;
+			bits = (bits | (bits << 4)) & 0x0f0f0f0fu;
+			bits = (bits | (bits << 2)) & 0x33333333u;
+			bits = (bits | (bits << 1)) & 0x55555555u;
+			return bits;
+		}
+	};
+
+	template<typename T, typename Layout = linear_layout>
 	class resource
 	{
 	public:
+		using layout = Layout;
+
 		resource(size_t size);
 		resource(size_t x_size, size_t y_size);
 		~resource();
 
+		// Items in storage order; use `copy_row` to read linear rows of a non-linear layout
 		const T* get_data();
 		T& item(size_t item);
 		T& item(size_t x, size_t y);
+		void copy_row(size_t y, T* destination);
 
 		size_t size_bytes() const;
 		size_t count() const;
@@ -31,53 +106,70 @@ namespace cg
 		std::vector<T> data;
 		size_t item_size = sizeof(T);
 		size_t stride;
+		size_t num_items;
 	};
 
-	template<typename T>
-	inline resource<T>::resource(size_t size)
-		: data(size), stride(0) {}
+	template<typename T, typename Layout>
+	inline resource<T, Layout>::resource(size_t size)
+		: data(size), stride(0), num_items(size) {}
 	
-	template<typename T>
-	inline resource<T>::resource(size_t x_size, size_t y_size)
-		: data(x_size * y_size), stride(x_size) {}
+	template<typename T, typename Layout>
+	inline resource<T, Layout>::resource(size_t x_size, size_t y_size)
+		: data(Layout::allocation(x_size, y_size)), stride(x_size), num_items(x_size * y_size) {}
 		
-	template<typename T>
-	inline resource<T>::~resource()
+	template<typename T, typename Layout>
+	inline resource<T, Layout>::~resource()
 	{
 	}
-	template<typename T>
-	inline const T* resource<T>::get_data()
+	template<typename T, typename Layout>
+	inline const T* resource<T, Layout>::get_data()
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
 		return data.data();
 	}
-	template<typename T>
-	inline T& resource<T>::item(size_t item)
+	template<typename T, typename Layout>
+	inline T& resource<T, Layout>::item(size_t item)
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
+		if constexpr (!std::is_same_v<Layout, linear_layout>)
+		{
+			if (stride)
+			{
+				return this->item(item % stride, item / stride);
+			}
+		}
 		return data[item];
 	}
-	template<typename T>
-	inline T& resource<T>::item(size_t x, size_t y)
+	template<typename T, typename Layout>
+	inline T& resource<T, Layout>::item(size_t x, size_t y)
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
-		return data[y * stride + x];
+		return data[Layout::offset(x, y, stride)];
 	}
-	template<typename T>
-	inline size_t resource<T>::size_bytes() const
+	template<typename T, typename Layout>
+	inline void resource<T, Layout>::copy_row(size_t y, T* destination)
+	{
+		for (size_t x = 0; x < stride; x += Layout::row_run)
+		{
+			const T* source = &item(x, y);
+			std::copy(source, source + std::min(Layout::row_run, stride - x), destination + x);
+		}
+	}
+	template<typename T, typename Layout>
+	inline size_t resource<T, Layout>::size_bytes() const
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
 		return data.size() * item_size;
 	}
-	template<typename T>
-	inline size_t resource<T>::count() const
+	template<typename T, typename Layout>
+	inline size_t resource<T, Layout>::count() const
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
-		return data.size();
+		return num_items;
 	}
 
-	template<typename T>
-	inline size_t resource<T>::get_stride() const
+	template<typename T, typename Layout>
+	inline size_t resource<T, Layout>::get_stride() const
 	{
 		// TODO Lab: 1.02 Implement `cg::resource` class
 		return stride;
@@ -131,30 +223,15 @@ namespace cg
 
 	struct vertex
 	{
-        float3 position;
-        float3 normal;
-        float3 color;
-    };
-
-    template<typename T>
-    class resource
-    {
-    public:
-        resource(size_t size);
-        resource(size_t x_size, size_t y_size);
-        ~resource();
-
-        const T* get_data();
-        T& item(size_t item);
-        T& item(size_t x, size_t y);
-        size_t size_bytes() const;
-        size_t count() const;
-        size_t get_stride() const;
-
-    protected:
-        std::vector<T> data;
-        size_t stride;
-        static constexpr size_t item_size = sizeof(T);
-    };
+		float3 position;
+		float3 normal;
+		float3 color;
+		float3 ambient;
+		float3 emissive;
+		// Top-left origin, wraps around outside [0, 1]
+		float2 texcoord;
+		// Index into the model's per-shape textures, -1 when untextured
+		int texture_id;
+	};
 
 }// namespace cg
\ No newline at end of file
@@ -25,6 +25,17 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	add_options("result_path", "Path to resulted image", cxxopts::value<std::filesystem::path>()->default_value("result.png"));
 	add_options("raytracing_depth", "Maximum number of traces rays", cxxopts::value<unsigned>()->default_value("1"));
 	add_options("accumulation_num", "Number of accumulated frames", cxxopts::value<unsigned>()->default_value("1"));
+	add_options("raytracing_bvh_builder", "BVH builder: sah for the faster tree, lbvh for the faster build", cxxopts::value<std::string>()->default_value("sah"));
+	add_options("raster_statistics", "Print frame timings and occlusion culling statistics", cxxopts::value<bool>()->default_value("false"));
+	add_options("raster_tile_binning", "Bin triangles into screen tiles and rasterize them in parallel", cxxopts::value<bool>()->default_value("true"));
+	add_options("raster_pipelining", "Process the geometry of the next shapes while the current one is rasterized", cxxopts::value<bool>()->default_value("false"));
+	add_options("raster_backface_culling", "Skip clockwise (back facing) triangles", cxxopts::value<bool>()->default_value("true"));
+	add_options("raster_visibility_buffer", "Rasterize triangle ids first and shade each visible pixel once", cxxopts::value<bool>()->default_value("false"));
+	add_options("raster_occlusion_culling", "Skip shapes hidden behind the largest shapes in a coarse depth buffer", cxxopts::value<bool>()->default_value("false"));
+	add_options("raster_depth_prepass", "Render depth first, then shade with an equal depth test", cxxopts::value<bool>()->default_value("false"));
+	add_options("raster_msaa", "Anti-alias edges with 4 coverage and depth samples per pixel", cxxopts::value<bool>()->default_value("false"));
+	add_options("raster_trilinear_filtering", "Blend the two nearest mip levels of textures instead of picking one", cxxopts::value<bool>()->default_value("true"));
+	add_options("raster_texture_compression", "Keep textures in memory as BC1/BC3 blocks and decode them while sampling", cxxopts::value<bool>()->default_value("false"));
 	add_options("h,help", "Print usage");
 
 	auto result = options.parse(argc, argv);
@@ -46,6 +57,17 @@ std::shared_ptr<settings> cg::settings::parse_settings(int argc, char** argv)
 	settings->result_path = result["result_path"].as<std::filesystem::path>();
 	settings->raytracing_depth = result["raytracing_depth"].as<unsigned>();
 	settings->accumulation_num = result["accumulation_num"].as<unsigned>();
+	settings->raytracing_bvh_builder = result["raytracing_bvh_builder"].as<std::string>();
+	settings->raster_statistics = result["raster_statistics"].as<bool>();
+	settings->raster_tile_binning = result["raster_tile_binning"].as<bool>();
+	settings->raster_pipelining = result["raster_pipelining"].as<bool>();
+	settings->raster_backface_culling = result["raster_backface_culling"].as<bool>();
+	settings->raster_visibility_buffer = result["raster_visibility_buffer"].as<bool>();
+	settings->raster_occlusion_culling = result["raster_occlusion_culling"].as<bool>();
+	settings->raster_depth_prepass = result["raster_depth_prepass"].as<bool>();
+	settings->raster_msaa = result["raster_msaa"].as<bool>();
+	settings->raster_trilinear_filtering = result["raster_trilinear_filtering"].as<bool>();
+	settings->raster_texture_compression = result["raster_texture_compression"].as<bool>();
 
 	return settings;
 }
@@ -27,6 +27,18 @@ namespace cg
 
 		unsigned raytracing_depth;
 		unsigned accumulation_num;
+		std::string raytracing_bvh_builder;
+
+		bool raster_statistics;
+		bool raster_tile_binning;
+		bool raster_pipelining;
+		bool raster_backface_culling;
+		bool raster_visibility_buffer;
+		bool raster_occlusion_culling;
+		bool raster_depth_prepass;
+		bool raster_msaa;
+		bool raster_trilinear_filtering;
+		bool raster_texture_compression;
 	};
 
 }// namespace cg
\ No newline at end of file
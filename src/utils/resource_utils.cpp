@@ -1,10 +1,12 @@
 //#define STBI_MSC_SECURE_CRT
+#define STB_IMAGE_IMPLEMENTATION
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 
 #include "resource_utils.h"
 
 #include "utils/error_handler.h"
 
+#include <stb_image.h>
 #include <stb_image_write.h>
 
 
@@ -38,3 +40,25 @@ void cg::utils::save_resource(cg::resource<cg::unsigned_color>& render_target, s
 		std::system(command.c_str());
 }
 
+std::shared_ptr<cg::renderer::texture> cg::utils::load_texture(const std::filesystem::path& filepath, bool compress)
+{
+	int width, height, channels;
+	unsigned char* data = stbi_load(filepath.string().c_str(), &width, &height, &channels, 4);
+	if (!data)
+		THROW_ERROR("Can't load the texture " + filepath.string());
+
+	cg::renderer::texture_format format = cg::renderer::texture_format::rgba8;
+	if (compress)
+	{
+		bool opaque = true;
+		for (size_t i = 0; i < static_cast<size_t>(width) * height && opaque; ++i)
+		{
+			opaque = data[4 * i + 3] == 255;
+		}
+		format = opaque ? cg::renderer::texture_format::bc1 : cg::renderer::texture_format::bc3;
+	}
+
+	auto texture = std::make_shared<cg::renderer::texture>(width, height, data, format);
+	stbi_image_free(data);
+	return texture;
+}
\ No newline at end of file
@@ -1,11 +1,31 @@
 #pragma once
 
+#include "renderer/texture.h"
 #include "resource.h"
 
 #include <filesystem>
+#include <memory>
 
 
 namespace cg::utils
 {
 	void save_resource(cg::resource<cg::unsigned_color>& render_target, std::filesystem::path filepath);
+	// Any format stb_image reads, expanded to RGBA with a full mip chain. Compressed
+	// textures are stored as BC1 when fully opaque and as BC3 otherwise.
+	std::shared_ptr<cg::renderer::texture> load_texture(const std::filesystem::path& filepath, bool compress = false);
+
+	// Non-linear layouts are detiled into linear rows first
+	template<typename Layout>
+	void save_resource(cg::resource<cg::unsigned_color, Layout>& render_target, std::filesystem::path filepath)
+	{
+		const size_t width = render_target.get_stride();
+		const size_t height = render_target.count() / width;
+		cg::resource<cg::unsigned_color> linear(width, height);
+		#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(height); ++y)
+		{
+			render_target.copy_row(y, &linear.item(0, y));
+		}
+		save_resource(linear, filepath);
+	}
 }
\ No newline at end of file
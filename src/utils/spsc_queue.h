@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+
+namespace cg::utils
+{
+	// Bounded lock-free ring buffer for exactly one producer and one consumer thread.
+	// Neither side blocks: try_push fails when full, try_pop when empty.
+	template<typename T>
+	class spsc_queue
+	{
+	public:
+		spsc_queue(size_t in_capacity) : slots(in_capacity){};
+		~spsc_queue(){};
+
+		// The item is only moved from on success
+		bool try_push(T& item);
+		bool try_pop(T& item);
+
+	protected:
+		std::vector<T> slots;
+		// Monotonic counters, the slot is the counter modulo the capacity.
+		// Each is written by one side only and kept on its own cache line.
+		alignas(64) std::atomic<size_t> head{0};
+		alignas(64) std::atomic<size_t> tail{0};
+	};
+
+	template<typename T>
+	inline bool spsc_queue<T>::try_push(T& item)
+	{
+		const size_t position = tail.load(std::memory_order_relaxed);
+		if (position - head.load(std::memory_order_acquire) == slots.size())
+		{
+			return false;
+		}
+		slots[position % slots.size()] = std::move(item);
+		tail.store(position + 1, std::memory_order_release);
+		return true;
+	}
+
+	template<typename T>
+	inline bool spsc_queue<T>::try_pop(T& item)
+	{
+		const size_t position = head.load(std::memory_order_relaxed);
+		if (position == tail.load(std::memory_order_acquire))
+		{
+			return false;
+		}
+		item = std::move(slots[position % slots.size()]);
+		head.store(position + 1, std::memory_order_release);
+		return true;
+	}
+}// namespace cg::utils
@@ -65,11 +65,13 @@ const float4x4 cg::world::camera::get_view_matrix() const
     float3 right = get_right();
     float3 up = get_up();
 
+    // linalg matrices are built from columns; the view looks along +direction,
+    // the same way the raytracer and the DX12 look-at matrix do
     return float4x4{
-        {right.x, right.y, right.z, -dot(right, position)},
-        {up.x, up.y, up.z, -dot(up, position)},
-        {-direction.x, -direction.y, -direction.z, dot(direction, position)},
-        {0.f, 0.f, 0.f, 1.f}
+        {right.x, up.x, direction.x, 0.f},
+        {right.y, up.y, direction.y, 0.f},
+        {right.z, up.z, direction.z, 0.f},
+        {-dot(right, position), -dot(up, position), -dot(direction, position), 1.f}
     };
 }
 
@@ -103,8 +105,8 @@ const float4x4 cg::world::camera::get_projection_matrix() const
     return float4x4{
         {f / aspect_ratio, 0.f, 0.f, 0.f},
         {0.f, f, 0.f, 0.f},
-        {0.f, 0.f, z_far / (z_far - z_near), (-z_far * z_near) / (z_far - z_near)},
-        {0.f, 0.f, 1.f, 0.f}
+        {0.f, 0.f, z_far / (z_far - z_near), 1.f},
+        {0.f, 0.f, (-z_far * z_near) / (z_far - z_near), 0.f}
     };
 }
 
@@ -4,7 +4,12 @@
 
 #include "utils/error_handler.h"
 
+#include <algorithm>
+#include <cctype>
+#include <limits>
 #include <linalg.h>
+#include <map>
+#include <tuple>
 
 
 using namespace linalg::aliases;
@@ -33,9 +38,10 @@ void model::allocate_buffers(const std::vector<tinyobj::shape_t>& shapes)
 {
     vertex_buffers.resize(shapes.size());
     index_buffers.resize(shapes.size());
+    shape_bounds.resize(shapes.size());
 
+    // Vertex buffers are created by fill_buffers once shared vertices are welded
     for (size_t i = 0; i < shapes.size(); i++) {
-        vertex_buffers[i] = std::make_shared<cg::resource<cg::vertex>>(shapes[i].mesh.indices.size());
         index_buffers[i] = std::make_shared<cg::resource<unsigned int>>(shapes[i].mesh.indices.size());
     }
 }
@@ -62,8 +68,10 @@ float3 cg::world::model::compute_normal(const tinyobj::attrib_t& attrib, const t
         attrib.vertices[3 * idx2.vertex_index + 2]
     };
 
-    float3 normal = normalize(cross(v1 - v0, v2 - v0));
-    return normal;
+    // Degenerate faces get a zero normal rather than a NaN one
+    float3 normal = cross(v1 - v0, v2 - v0);
+    float normal_length = length(normal);
+    return normal_length > 0.f ? normal / normal_length : float3{0.f, 0.f, 0.f};
 }
 
 
@@ -76,14 +84,58 @@ void model::fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib
     };
     vertex.normal = computed_normal;
     vertex.color = float3{material.diffuse[0], material.diffuse[1], material.diffuse[2]};
+    vertex.ambient = float3{material.ambient[0], material.ambient[1], material.ambient[2]};
+    vertex.emissive = float3{material.emission[0], material.emission[1], material.emission[2]};
+    // OBJ puts v = 0 at the bottom of the image, textures start with the top row
+    vertex.texcoord = idx.texcoord_index >= 0
+        ? float2{
+            attrib.texcoords[2 * idx.texcoord_index + 0],
+            1.f - attrib.texcoords[2 * idx.texcoord_index + 1]}
+        : float2{0.f, 0.f};
+    vertex.texture_id = -1;
+}
+
+std::filesystem::path cg::world::model::find_texture(const std::string& texture_name, const std::filesystem::path& base_folder)
+{
+    if (texture_name.empty()) {
+        return {};
+    }
+    std::filesystem::path texture_path = base_folder / texture_name;
+    if (std::filesystem::exists(texture_path)) {
+        return texture_path;
+    }
+
+    // Material files written on Windows often disagree with the file names in case
+    const auto lower = [](std::string name) {
+        std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+        return name;
+    };
+    const std::string wanted = lower(texture_path.filename().string());
+    std::error_code error;
+    for (const auto& entry : std::filesystem::directory_iterator(texture_path.parent_path(), error)) {
+        if (lower(entry.path().filename().string()) == wanted) {
+            return entry.path();
+        }
+    }
+    return {};
 }
 
 void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder)
 {
+    textures.resize(shapes.size());
     for (size_t i = 0; i < shapes.size(); i++) {
+        // A shape is textured with the diffuse map of its first face's material
+        const int first_material = shapes[i].mesh.material_ids.empty() ? -1 : shapes[i].mesh.material_ids[0];
+        textures[i] = first_material >= 0 ? find_texture(materials[first_material].diffuse_texname, base_folder) : std::filesystem::path{};
+        const int texture_id = textures[i].empty() ? -1 : static_cast<int>(i);
+
+        // Corners with the same position, texture coordinate, normal and material become one indexed vertex
+        std::vector<cg::vertex> vertices;
+        std::map<std::tuple<int, int, int, float, float, float>, unsigned int> unique_vertices;
+
         size_t index_offset = 0;
         for (size_t f = 0; f < shapes[i].mesh.num_face_vertices.size(); f++) {
-            int fv = shapes[i].mesh.num_face_vertices[f];
+            size_t fv = shapes[i].mesh.num_face_vertices[f];
 
             float3 normal = compute_normal(attrib, shapes[i].mesh, index_offset);
 
@@ -91,14 +143,31 @@ void model::fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tiny
                 tinyobj::index_t idx = shapes[i].mesh.indices[index_offset + v];
                 tinyobj::material_t material = materials[shapes[i].mesh.material_ids[f]];
 
-                cg::vertex vertex;
-                fill_vertex_data(vertex, attrib, idx, normal, material);
-
-                vertex_buffers[i]->item(index_offset + v) = vertex;
-                index_buffers[i]->item(index_offset + v) = index_offset + v;
+                auto [unique_vertex, inserted] = unique_vertices.try_emplace(
+                    std::make_tuple(idx.vertex_index, idx.texcoord_index, shapes[i].mesh.material_ids[f], normal.x, normal.y, normal.z),
+                    static_cast<unsigned int>(vertices.size()));
+                if (inserted) {
+                    cg::vertex vertex;
+                    fill_vertex_data(vertex, attrib, idx, normal, material);
+                    vertex.texture_id = texture_id;
+                    vertices.push_back(vertex);
+                }
+
+                index_buffers[i]->item(index_offset + v) = unique_vertex->second;
             }
             index_offset += fv;
         }
+
+        vertex_buffers[i] = std::make_shared<cg::resource<cg::vertex>>(vertices.size());
+        bounding_box bounds{
+            float3{std::numeric_limits<float>::max(), std::numeric_limits<float>::max(), std::numeric_limits<float>::max()},
+            float3{std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest(), std::numeric_limits<float>::lowest()}};
+        for (size_t v = 0; v < vertices.size(); v++) {
+            vertex_buffers[i]->item(v) = vertices[v];
+            bounds.min = min(bounds.min, vertices[v].position);
+            bounds.max = max(bounds.max, vertices[v].position);
+        }
+        shape_bounds[i] = bounds;
     }
 }
 
@@ -121,6 +190,12 @@ const std::vector<std::filesystem::path>& cg::world::model::get_per_shape_textur
 }
 
 
+const std::vector<cg::world::bounding_box>& cg::world::model::get_shape_bounds() const
+{
+	return shape_bounds;
+}
+
+
 const float4x4 cg::world::model::get_world_matrix() const
 {
 	return float4x4{
@@ -11,6 +11,13 @@ using namespace linalg::aliases;
 
 namespace cg::world
 {
+	// Axis-aligned bounds of one shape in model space
+	struct bounding_box
+	{
+		float3 min;
+		float3 max;
+	};
+
 	class model
 	{
 	public:
@@ -21,7 +28,9 @@ namespace cg::world
 
 		const std::vector<std::shared_ptr<cg::resource<cg::vertex>>>& get_vertex_buffers() const;
 		const std::vector<std::shared_ptr<cg::resource<unsigned int>>>& get_index_buffers() const;
+		// Diffuse texture of each shape, empty when the shape has none; vertices refer to it by shape index
 		const std::vector<std::filesystem::path>& get_per_shape_texture_files() const;
+		const std::vector<bounding_box>& get_shape_bounds() const;
 
 		const float4x4 get_world_matrix() const;
 
@@ -30,9 +39,11 @@ namespace cg::world
 		std::vector<std::shared_ptr<cg::resource<cg::vertex>>> vertex_buffers;
 		std::vector<std::shared_ptr<cg::resource<unsigned int>>> index_buffers;
 		std::vector<std::filesystem::path> textures;
+		std::vector<bounding_box> shape_bounds;
 
 		void allocate_buffers(const std::vector<tinyobj::shape_t>& shapes);
 		static float3 compute_normal(const tinyobj::attrib_t& attrib, const tinyobj::mesh_t& mesh, size_t index_offset);
+		static std::filesystem::path find_texture(const std::string& texture_name, const std::filesystem::path& base_folder);
 		static void fill_vertex_data(cg::vertex& vertex, const tinyobj::attrib_t& attrib, tinyobj::index_t idx, float3 computed_normal, tinyobj::material_t material);
 		void fill_buffers(const std::vector<tinyobj::shape_t>& shapes, const tinyobj::attrib_t& attrib, const std::vector<tinyobj::material_t>& materials, const std::filesystem::path& base_folder);
 	};